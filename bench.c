@@ -0,0 +1,363 @@
+/*
+ * bench.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * fritzident-bench - load generator for fritzident and libfritzident.
+ *
+ * Opens a set of TCP and UDP sockets of its own, so the socket tables have
+ * something to find, then either talks to a running daemon from several
+ * threads, calls fi_lookup() directly (-l) or looks ports up in socket
+ * tables loaded once (-T), which leaves out the kernel; -L puts that many
+ * sockets of another address in front of the own ones, so every lookup
+ * walks a table as large as a busy server has.  The query mix is 60% TCP
+ * and 10% UDP ports that exist, 20% ports that do not and 10% USERS.
+ * Prints throughput and latency percentiles; with -P also the CPU time and
+ * context switches the daemon spent per request.  "make benchmark" runs it
+ * against a freshly started daemon; "make pgo" uses the same run for
+ * training.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fritzident.h"
+#include "netinfo.h"
+
+#define MAX_SOCKETS 4096
+
+static int port = 14013;
+static int threads = 4;
+static long requests = 10000;
+static int nsockets = 64;
+static int library = 0;
+static int table = 0;
+static long table_lines = 40000;
+static pid_t daemon_pid = 0;
+static struct port_table tcp_table, udp_table;
+static unsigned short tcp_ports[MAX_SOCKETS];
+static unsigned short udp_ports[MAX_SOCKETS];
+static fi_context *ctx;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	long count;
+	long failed;
+	long *latency;	/* ns per request */
+};
+
+static long elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+static unsigned short open_socket(int type)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd = socket(AF_INET, type, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || (type == SOCK_STREAM && listen(fd, 1) < 0)
+	    || getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	return ntohs(addr.sin_port);
+}
+
+// the i-th query of the mix
+static void query(long i, int *proto, unsigned int *qport)
+{
+	int kind = i % 10;
+
+	*proto = kind == 6 ? IPPROTO_UDP : IPPROTO_TCP;
+	if (kind < 6)
+		*qport = tcp_ports[i % nsockets];
+	else if (kind == 6)
+		*qport = udp_ports[i % nsockets];
+	else if (kind < 9)
+		*qport = 1 + i % 1000;	/* privileged range, nothing listens there */
+	else
+		*qport = 0;		/* USERS */
+}
+
+static int ask(const char *cmd)
+{
+	struct sockaddr_in addr;
+	char buf[4096];
+	int fd, n, total = 0, banner = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	/* the banner ends with a NUL, then the command may be sent */
+	while (!banner && (n = recv(fd, buf, sizeof(buf), 0)) > 0)
+		banner = memchr(buf, '\0', n) != NULL;
+	if (banner && send(fd, cmd, strlen(cmd), 0) == (ssize_t)strlen(cmd))
+		while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+			total += n;
+	close(fd);
+	return banner && total > 0 ? 0 : -1;
+}
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	struct timespec start, end;
+	char cmd[64], name[FI_NAME_MAX];
+	unsigned int qport;
+	int proto, rc;
+	long i;
+
+	for (i = 0; i < w->count; i++) {
+		query(i * threads + w->id, &proto, &qport);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (table) {
+			rc = 0;
+			if (qport)
+				ipv4_table_port_uid(proto == IPPROTO_TCP ? &tcp_table : &udp_table,
+						    "127.0.0.1", qport);
+		}
+		else if (library) {
+			if (qport == 0)
+				rc = 0;	/* USERS is not a lookup */
+			else
+				rc = fi_lookup(ctx, proto, "127.0.0.1", qport, name, sizeof(name))
+					== FI_ERROR ? -1 : 0;
+		}
+		else {
+			if (qport == 0)
+				snprintf(cmd, sizeof(cmd), "USERS\r\n");
+			else
+				snprintf(cmd, sizeof(cmd), "%s 127.0.0.1:%u\r\n",
+					 proto == IPPROTO_TCP ? "TCP" : "UDP", qport);
+			rc = ask(cmd);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		w->latency[i] = elapsed_ns(&start, &end);
+		if (rc < 0)
+			w->failed++;
+	}
+	return NULL;
+}
+
+/* put lines sockets of 127.0.0.2 between the header and the real ones */
+static int pad_table(struct port_table *t, long lines)
+{
+	static const char fmt[] = "%6ld: 0200007F:%04lX 00000000:0000 06 00000000:00000000"
+		" 03:00000000 00000000  1000        0 0 3 0000000000000000\n";
+	char *body, *data, *p;
+	size_t head;
+	long i;
+
+	if ((body = strchr(t->data, '\n')) == NULL)
+		return 0;
+	head = ++body - t->data;
+	if ((data = malloc(t->len + lines * 128 + 1)) == NULL)
+		return -1;
+	memcpy(data, t->data, head);
+	p = data + head;
+	for (i = 0; i < lines; i++)
+		p += sprintf(p, fmt, i, i % 65536);
+	memcpy(p, body, t->len - head + 1);
+	t->len = p - data + t->len - head;
+	free(t->data);
+	t->data = data;
+	return 0;
+}
+
+/* CPU time in us and context switches of a process so far */
+static int process_usage(pid_t pid, long *cpu_us, long *switches)
+{
+	char path[64], line[256];
+	unsigned long utime, stime;
+	long n;
+	FILE *file;
+	DIR *dir;
+	struct dirent *task;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((file = fopen(path, "r")) == NULL)
+		return -1;
+	/* the command name may contain blanks, skip past its closing paren */
+	if (fgets(line, sizeof(line), file) == NULL || strrchr(line, ')') == NULL
+	    || sscanf(strrchr(line, ')') + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		      &utime, &stime) != 2) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	*cpu_us = (utime + stime) * (1000000 / sysconf(_SC_CLK_TCK));
+
+	/* switches are counted per thread */
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+	if ((dir = opendir(path)) == NULL)
+		return -1;
+	*switches = 0;
+	while ((task = readdir(dir)) != NULL) {
+		if (task->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%.16s/status", (int)pid, task->d_name);
+		if ((file = fopen(path, "r")) == NULL)
+			continue;
+		while (fgets(line, sizeof(line), file))
+			if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1
+			    || sscanf(line, "nonvoluntary_ctxt_switches: %ld", &n) == 1)
+				*switches += n;
+		fclose(file);
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *cmdname)
+{
+	printf("Usage: %s [-l|-T [-L lines]] [-p port] [-P pid] [-t threads] [-n requests] [-s sockets]\n", cmdname);
+	printf("\t-l ........ call libfritzident directly instead of the daemon\n");
+	printf("\t-T ........ look up in socket tables read once (user space only)\n");
+	printf("\t-L n ...... other sockets in front of the own ones with -T (default 40000)\n");
+	printf("\t-p port ... daemon port (default 14013)\n");
+	printf("\t-P pid .... report the CPU time the daemon with this pid used\n");
+	printf("\t-t n ...... concurrent clients (default 4)\n");
+	printf("\t-n n ...... requests in total (default 10000)\n");
+	printf("\t-s n ...... TCP and UDP sockets to open (default 64)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	struct timespec start, end;
+	long *all, total, failed = 0, per, i;
+	long cpu_before = 0, cpu_after, switches_before = 0, switches_after;
+	double seconds;
+	int c, t;
+
+	while ((c = getopt(argc, argv, "lTL:p:P:t:n:s:h")) != -1) {
+		switch (c) {
+		case 'l': library = 1; break;
+		case 'T': table = 1; break;
+		case 'L': table_lines = atol(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		case 'P': daemon_pid = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'n': requests = atol(optarg); break;
+		case 's': nsockets = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1 || requests < threads || nsockets < 1 || nsockets > MAX_SOCKETS
+	    || table_lines < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = 0; i < nsockets; i++) {
+		tcp_ports[i] = open_socket(SOCK_STREAM);
+		udp_ports[i] = open_socket(SOCK_DGRAM);
+	}
+	if (table && (ipv4_tcp_table_load(&tcp_table) < 0 || ipv4_udp_table_load(&udp_table) < 0)) {
+		perror("/proc/net");
+		return 1;
+	}
+	if (table && (pad_table(&tcp_table, table_lines) < 0 || pad_table(&udp_table, table_lines) < 0)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	if (library) {
+		if ((ctx = fi_context_new()) == NULL
+		    || fi_add_uid_range(ctx, 1000, 65533) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+	}
+
+	per = requests / threads;
+	total = per * threads;
+	workers = calloc(threads, sizeof(*workers));
+	all = calloc(total, sizeof(*all));
+	if (workers == NULL || all == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	if (daemon_pid && process_usage(daemon_pid, &cpu_before, &switches_before) < 0) {
+		perror("/proc");
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (t = 0; t < threads; t++) {
+		workers[t].id = t;
+		workers[t].count = per;
+		workers[t].latency = all + t * per;
+		if (pthread_create(&workers[t].thread, NULL, run, &workers[t]) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (t = 0; t < threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		failed += workers[t].failed;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	seconds = elapsed_ns(&start, &end) / 1e9;
+	qsort(all, total, sizeof(*all), compare_long);
+	printf("%s: %ld requests, %d threads, %d sockets, %ld failed\n",
+	       table ? "table" : library ? "library" : "daemon", total, threads, nsockets, failed);
+	if (table)
+		printf("tables padded with %ld other sockets\n", table_lines);
+	printf("throughput %.0f req/s, latency p50 %ld us, p99 %ld us, max %ld us\n",
+	       total / seconds, all[total / 2] / 1000, all[total * 99 / 100] / 1000,
+	       all[total - 1] / 1000);
+	if (daemon_pid && process_usage(daemon_pid, &cpu_after, &switches_after) == 0)
+		printf("daemon cpu %.1f us/req, %.2f context switches/req\n",
+		       (double)(cpu_after - cpu_before) / total,
+		       (double)(switches_after - switches_before) / total);
+	fi_context_free(ctx);
+	port_table_free(&tcp_table);
+	port_table_free(&udp_table);
+	return failed ? 2 : 0;
+}
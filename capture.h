@@ -0,0 +1,29 @@
+/*
+ * capture.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+
+/*
+ * Hooks for the trace capture (trace.c) and fritzident-replay, not part of
+ * the libfritzident API.  The replay points the lookups of the whole
+ * process at the captured socket tables and passwd entries; these are not
+ * thread safe, call them before the first lookup.  Needs fritzident.h.
+ */
+int fi_write_passwd(const fi_context *ctx, FILE *out);
+void fi_set_passwd_file(const char *path);
+void ipv4_set_table_paths(const char *tcp, const char *udp);
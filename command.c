@@ -0,0 +1,252 @@
+/*
+ * command.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * One IDENT command from parsing to the reply, shared by the serving loops
+ * in main.c and uring.c and by fritzident-replay, so a replay runs exactly
+ * the code the daemon answers with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fritzident.h"
+#include "netinfo.h"
+#include "config.h"
+#include "prefetch.h"
+#include "snapshot.h"
+#include "negcache.h"
+#include "reply.h"
+#include "trace.h"
+#include "stats.h"
+#include "strategy.h"
+#include "server.h"
+#include "debug.h"
+
+static int sendUser(const struct fi_user *user, void *arg)
+{
+    debugLog(LOG_DEBUG, "USERS: %s\n", user->name);
+    reply_line(arg, "", user->name);
+    return 0;
+}
+
+/* a connection was accepted: count it and start its trace record, with
+ * the stage times if timed */
+void startRequest(struct request *req, int timed)
+{
+    memset(req, 0, sizeof(*req));
+    req->timed = timed;
+    if (timed) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	req->rec.time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	clock_gettime(CLOCK_MONOTONIC, &req->last);
+    }
+    stats_inc(STAT_CONNECTIONS);
+}
+
+/* charge the time since the previous stage to stage s */
+void traceStage(struct request *req, enum trace_stage s)
+{
+    struct timespec now;
+
+    if (!req->timed)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    req->rec.stage_us[s] += stats_elapsed_us(&req->last, &now);
+    req->last = now;
+}
+
+static void execUSERS(const struct config *cfg, struct reply *out)
+{
+    size_t len;
+    const char *users = snapshot_users(cfg, &len);
+    if (users) {
+        /* pre-rendered, including the NUL after every line */
+        reply_append(out, users, len);
+        return;
+    }
+
+    fi_users(cfg->ctx, sendUser, out);
+}
+
+/* use the shared or prefetched snapshot if there is one, otherwise ask the
+ * backend the lookup strategy picks */
+static uid_t lookup_port_uid(const struct config *cfg, struct prefetch *pf, struct request *req,
+			     int proto, const char *ipv4, unsigned int port)
+{
+    enum lookup_strategy used;
+    uid_t uid;
+    if (negcache_hit(cfg->negative_ttl, proto, ipv4, port)) {
+        req->rec.source = TRACE_NEGCACHE;
+        return UID_NOT_FOUND;
+    }
+    uid = snapshot_port_uid(cfg, proto, ipv4, port);
+    if (uid != UID_NOT_FOUND) {
+        req->rec.source = TRACE_SNAPSHOT;
+        return uid;
+    }
+    uid = prefetch_port_uid(pf, proto, ipv4, port);
+    if (uid != UID_NOT_FOUND || prefetch_complete(pf, proto)) {
+        req->rec.source = TRACE_PREFETCH;
+        if (uid == UID_NOT_FOUND)
+            negcache_add(cfg->negative_ttl, proto, ipv4, port);
+        return uid;
+    }
+    uid = strategy_port_uid(cfg->lookup, proto, ipv4, port, &used);
+    req->rec.source = used == LOOKUP_NETLINK ? TRACE_NETLINK
+	: used == LOOKUP_INDEX ? TRACE_INDEX : TRACE_PROC;
+    if (uid == UID_NOT_FOUND)
+        negcache_add(cfg->negative_ttl, proto, ipv4, port);
+    return uid;
+}
+
+/* name sent to the Fritz!Box for an included user, NULL if unknown */
+static const char *user_identity(const struct config *cfg, uid_t uid, char *name, size_t len)
+{
+    const char *shared = snapshot_identity(cfg, uid);
+    if (shared)
+        return shared;
+    return fi_user_identity(cfg->ctx, uid, name, len);
+}
+
+static void execTCP(const struct config *cfg, struct prefetch *pf, struct request *req,
+		    struct reply *out, const char *ipv4, const char *port)
+{
+    unsigned int portNumber;
+    uid_t uid;
+    sscanf(port, "%u", &portNumber);
+    uid = lookup_port_uid(cfg, pf, req, IPPROTO_TCP, ipv4, portNumber);
+    req->rec.uid = uid;
+    traceStage(req, TRACE_LOOKUP);
+    if (uid != UID_NOT_FOUND) {
+        if (fi_included_uid(cfg->ctx, uid)) {
+            char buffer[FI_NAME_MAX];
+            const char *name = user_identity(cfg, uid, buffer, sizeof(buffer));
+            traceStage(req, TRACE_IDENTITY);
+            debugLog(LOG_DEBUG, "TCP %s: %s\n", port, name ? name : "(unknown)");
+            if (name) {
+                reply_line(out, "USER ", name);
+                req->rec.result = TRACE_USER;
+            }
+            else {
+                reply_line(out, "ERROR UNSPECIFIED", NULL);
+                req->rec.result = TRACE_UNSPECIFIED;
+            }
+        }
+        else {
+            reply_line(out, "ERROR SYSTEM_USER", NULL);
+            req->rec.result = TRACE_SYSTEM_USER;
+        }
+    }
+    else {
+        reply_line(out, "ERROR NOT_FOUND", NULL);
+        req->rec.result = TRACE_NOT_FOUND;
+    }
+}
+
+static void execUDP(const struct config *cfg, struct prefetch *pf, struct request *req,
+		    struct reply *out, const char *ipv4, const char *port)
+{
+    unsigned int portNumber;
+    uid_t uid;
+    sscanf(port, "%u", &portNumber);
+    uid = lookup_port_uid(cfg, pf, req, IPPROTO_UDP, ipv4, portNumber);
+    req->rec.uid = uid;
+    traceStage(req, TRACE_LOOKUP);
+    if (uid != UID_NOT_FOUND) {
+        if (fi_included_uid(cfg->ctx, uid)) {
+            char buffer[FI_NAME_MAX];
+            const char *name = user_identity(cfg, uid, buffer, sizeof(buffer));
+            traceStage(req, TRACE_IDENTITY);
+            debugLog(LOG_DEBUG, "UDP %s: %s\n", port, name ? name : "(unknown)");
+            if (name) {
+                reply_line(out, "USER ", name);
+                req->rec.result = TRACE_USER;
+            }
+            else {
+                reply_line(out, "ERROR UNSPECIFIED", NULL);
+                req->rec.result = TRACE_UNSPECIFIED;
+            }
+        }
+        else {
+            reply_line(out, "ERROR SYSTEM_USER", NULL);
+            req->rec.result = TRACE_SYSTEM_USER;
+        }
+    }
+    else {
+        reply_line(out, "ERROR NOT_FOUND", NULL);
+        req->rec.result = TRACE_NOT_FOUND;
+    }
+}
+
+/* parse one command and put the answer into out; cmd is modified */
+void answerCommand(const struct config *cfg, struct prefetch *pf, struct request *req,
+		   struct reply *out, char *cmd)
+{
+    /* the first token is containing the command which might be
+     * USERS, TCP, or UDP and is usually seperated by spaces */
+    char *saveptr;
+    char *cmdVerb = strtok_r(cmd, "\r\n ", &saveptr);
+
+    /* debugLog("Received command: \"%s\"\n", cmdVerb); */
+    if (cmdVerb == NULL) {
+	reply_line(out, "ERROR UNSPECIFIED", NULL);
+    }
+    else if (strcmp(cmdVerb, "USERS") == 0) {
+	req->rec.command = TRACE_USERS;
+	req->rec.result = TRACE_LIST;
+	execUSERS(cfg, out);
+	traceStage(req, TRACE_LOOKUP);
+    }
+    else if (strcmp(cmdVerb, "TCP") == 0) {
+	char *localIp = strtok_r(NULL, ":", &saveptr);
+	char *localPort = strtok_r(NULL, "\r\n", &saveptr);
+	debugLog(LOG_DEBUG, "Searching for \"%s:%s\"\n", localIp, localPort);
+	if(localIp != NULL && localPort != NULL) {
+	    req->rec.command = TRACE_TCP;
+	    inet_pton(AF_INET, localIp, &req->rec.addr);
+	    req->rec.port = atoi(localPort);
+	    execTCP(cfg, pf, req, out, localIp, localPort);
+	}
+	else reply_line(out, "ERROR UNSPECIFIED", NULL);
+    }
+    else if (strcmp(cmdVerb, "UDP") == 0) {
+	char *localIp = strtok_r(NULL, ":", &saveptr);
+	char *localPort = strtok_r(NULL, "\r\n", &saveptr);
+	debugLog(LOG_DEBUG, "Searching for \"%s:%s\"\n", localIp, localPort);
+	if(localIp != NULL && localPort != NULL) {
+	    req->rec.command = TRACE_UDP;
+	    inet_pton(AF_INET, localIp, &req->rec.addr);
+	    req->rec.port = atoi(localPort);
+	    execUDP(cfg, pf, req, out, localIp, localPort);
+	}
+	else reply_line(out, "ERROR UNSPECIFIED", NULL);
+    } else {
+	debugLog(LOG_NOTICE, "Unrecognized command \"%s\"\n", cmd);
+	reply_line(out, "ERROR UNSPECIFIED", NULL);
+    }
+    if (req->rec.result == TRACE_NONE)
+	req->rec.result = TRACE_UNSPECIFIED;
+}
@@ -0,0 +1,425 @@
+/*
+ * config.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "config.h"
+#include "snapshot.h"
+#include "negcache.h"
+#include "trace.h"
+#include "debug.h"
+
+#define MAX_READERS (CONFIG_MAX_THREADS + 4)
+
+void config_defaults(struct config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->nranges = 2;
+	cfg->ranges[0].min = 1000;
+	cfg->ranges[0].max = 65533;
+	cfg->ranges[1].min = 65537;
+	cfg->ranges[1].max = (uid_t)-1;
+	cfg->backend = BACKEND_PROC;
+	cfg->snapshot_ttl = SNAPSHOT_TTL;
+	cfg->negative_ttl = NEGCACHE_TTL;
+	cfg->timeout = CONFIG_TIMEOUT;
+	cfg->threads = 1;
+	cfg->trace_slots = TRACE_SLOTS;
+}
+
+void config_free(struct config *cfg)
+{
+	if (cfg == NULL)
+		return;
+	fi_context_free(cfg->ctx);
+	free(cfg->domain);
+	free(cfg->snapshot_file);
+	free(cfg->trace_file);
+	free(cfg);
+}
+
+static int parse_long(const char *value, long min, long max, long *result)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(value, &end, 10);
+	if (errno || end == value || *end || n < min || n > max)
+		return -1;
+	*result = n;
+	return 0;
+}
+
+static int parse_double(const char *value, double *result)
+{
+	char *end;
+	double n = strtod(value, &end);
+
+	if (end == value || *end || n < 0)
+		return -1;
+	*result = n;
+	return 0;
+}
+
+static int parse_bool(const char *value, int *result)
+{
+	if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcmp(value, "1"))
+		*result = 1;
+	else if (!strcasecmp(value, "no") || !strcasecmp(value, "false") || !strcmp(value, "0"))
+		*result = 0;
+	else
+		return -1;
+	return 0;
+}
+
+static int replace_string(char **field, const char *value)
+{
+	char *copy = strdup(value);
+	if (copy == NULL)
+		return -1;
+	free(*field);
+	*field = copy;
+	return 0;
+}
+
+static const struct {
+	const char *key;
+	unsigned int cmdline;
+} cmdline_keys[] = {
+	{ "domain", CONFIG_CMDLINE_DOMAIN },
+	{ "prefetch", CONFIG_CMDLINE_PREFETCH },
+	{ "backend", CONFIG_CMDLINE_SNAPSHOT },
+	{ "snapshot_file", CONFIG_CMDLINE_SNAPSHOT },
+	{ "snapshot_ttl", CONFIG_CMDLINE_SNAPSHOT_TTL },
+	{ "negative_ttl", CONFIG_CMDLINE_NEGATIVE_TTL },
+	{ "client_rate", CONFIG_CMDLINE_CLIENT_RATE },
+	{ "client_burst", CONFIG_CMDLINE_CLIENT_BURST },
+	{ "trace_file", CONFIG_CMDLINE_TRACE },
+	{ "io_uring", CONFIG_CMDLINE_IO_URING },
+};
+
+// true if key was given on the command line, which wins over the file
+static int cmdline_key(const struct config *cfg, const char *key)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(cmdline_keys) / sizeof(cmdline_keys[0]); i++)
+		if (!strcmp(key, cmdline_keys[i].key))
+			return (cfg->cmdline & cmdline_keys[i].cmdline) != 0;
+	return 0;
+}
+
+// apply one "key = value" line, returns -1 for unknown keys or bad values
+static int config_set(struct config *cfg, const char *key, const char *value,
+		      int *ranges_seen)
+{
+	long n;
+
+	if (!strcmp(key, "domain"))
+		return replace_string(&cfg->domain, value);
+	if (!strcmp(key, "uid_range")) {
+		unsigned long min, max;
+		char dash;
+		/* the first uid_range in a file replaces the built-in ranges */
+		if (!*ranges_seen) {
+			cfg->nranges = 0;
+			*ranges_seen = 1;
+		}
+		if (cfg->nranges == CONFIG_MAX_RANGES
+		    || sscanf(value, "%lu %c %lu", &min, &dash, &max) != 3
+		    || dash != '-' || min > max)
+			return -1;
+		cfg->ranges[cfg->nranges].min = min;
+		cfg->ranges[cfg->nranges].max = max;
+		cfg->nranges++;
+		return 0;
+	}
+	if (!strcmp(key, "backend")) {
+		if (!strcmp(value, "proc"))
+			cfg->backend = BACKEND_PROC;
+		else if (!strcmp(value, "snapshot"))
+			cfg->backend = BACKEND_SNAPSHOT;
+		else
+			return -1;
+		return 0;
+	}
+	if (!strcmp(key, "lookup")) {
+		if (!strcmp(value, "auto"))
+			cfg->lookup = LOOKUP_AUTO;
+		else if (!strcmp(value, "proc"))
+			cfg->lookup = LOOKUP_PROC;
+		else if (!strcmp(value, "netlink"))
+			cfg->lookup = LOOKUP_NETLINK;
+		else if (!strcmp(value, "index"))
+			cfg->lookup = LOOKUP_INDEX;
+		else
+			return -1;
+		return 0;
+	}
+	if (!strcmp(key, "snapshot_file"))
+		return replace_string(&cfg->snapshot_file, value);
+	if (!strcmp(key, "snapshot_ttl"))
+		return parse_long(value, 1, 3600000, &cfg->snapshot_ttl);
+	if (!strcmp(key, "prefetch"))
+		return parse_bool(value, &cfg->prefetch);
+	if (!strcmp(key, "negative_ttl"))
+		return parse_long(value, 0, 3600000, &cfg->negative_ttl);
+	if (!strcmp(key, "client_rate"))
+		return parse_double(value, &cfg->client_rate);
+	if (!strcmp(key, "client_burst"))
+		return parse_double(value, &cfg->client_burst);
+	if (!strcmp(key, "timeout"))
+		return parse_long(value, 0, 3600000, &cfg->timeout);
+	if (!strcmp(key, "trace_file"))
+		return replace_string(&cfg->trace_file, value);
+	if (!strcmp(key, "trace_slots"))
+		return parse_long(value, 16, 16777216, &cfg->trace_slots);
+	if (!strcmp(key, "io_uring"))
+		return parse_bool(value, &cfg->io_uring);
+	if (!strcmp(key, "threads")) {
+		if (parse_long(value, 1, CONFIG_MAX_THREADS, &n) < 0)
+			return -1;
+		cfg->threads = n;
+		return 0;
+	}
+	return -1;
+}
+
+static char *trim(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return s;
+}
+
+static int config_parse(struct config *cfg, const char *path, FILE *file)
+{
+	char line[512];
+	int lineno = 0;
+	int ranges_seen = 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		char *key, *value, *p;
+
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		key = trim(line);
+		if (*key == '\0')
+			continue;
+		if ((p = strchr(key, '=')) == NULL) {
+			debugLog(LOG_ERR, "%s:%i: missing \"=\"\n", path, lineno);
+			return -1;
+		}
+		*p = '\0';
+		key = trim(key);
+		value = trim(p + 1);
+		if (cmdline_key(cfg, key)) {
+			debugLog(LOG_INFO, "%s:%i: \"%s\" is set on the command line, ignored\n",
+				 path, lineno, key);
+			continue;
+		}
+		if (config_set(cfg, key, value, &ranges_seen) < 0) {
+			debugLog(LOG_ERR, "%s:%i: invalid setting \"%s\"\n", path, lineno, key);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Build a new config: start from base (defaults plus command line), apply
+ * the file except for what the command line set and set up the lookup
+ * context.  A missing file is only an error
+ * if it was named explicitly.  Returns NULL on errors, which are logged.
+ */
+struct config *config_load(const char *path, const struct config *base)
+{
+	struct config *cfg;
+	FILE *file = NULL;
+	int i;
+
+	if ((cfg = malloc(sizeof(*cfg))) == NULL)
+		return NULL;
+	*cfg = *base;
+	cfg->domain = base->domain ? strdup(base->domain) : NULL;
+	cfg->snapshot_file = strdup(base->snapshot_file ? base->snapshot_file : SNAPSHOT_PATH);
+	cfg->trace_file = base->trace_file ? strdup(base->trace_file) : NULL;
+	cfg->ctx = NULL;
+	if ((base->domain && cfg->domain == NULL) || cfg->snapshot_file == NULL
+	    || (base->trace_file && cfg->trace_file == NULL))
+		goto fail;
+
+	if (path)
+		file = fopen(path, "re");
+	if (file) {
+		int rc = config_parse(cfg, path, file);
+		fclose(file);
+		if (rc < 0)
+			goto fail;
+	}
+	else if (path && (errno != ENOENT || strcmp(path, CONFIG_FILE) != 0)) {
+		debugLog(LOG_ERR, "%s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	if ((cfg->ctx = fi_context_new()) == NULL)
+		goto fail;
+	for (i = 0; i < cfg->nranges; i++)
+		if (fi_add_uid_range(cfg->ctx, cfg->ranges[i].min, cfg->ranges[i].max) < 0)
+			goto fail;
+	if (cfg->domain && fi_set_domain(cfg->ctx, cfg->domain) < 0)
+		goto fail;
+	return cfg;
+
+fail:
+	config_free(cfg);
+	return NULL;
+}
+
+/*
+ * Grace periods.  Every serving thread owns a slot that holds the config
+ * generation it started its current connection with, or 0 while it is
+ * idle.  A replaced config is freed once no slot refers to its generation
+ * or an older one; config_reclaim() checks that on the next publish and
+ * from the housekeeping of the serving loops.
+ */
+static struct config *current = NULL;
+static unsigned long current_gen = 1;
+static unsigned long readers[MAX_READERS];
+static int reader_used[MAX_READERS];
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int reader_slot = -1;
+
+/* replaced configs still in use, newest first */
+struct retired {
+	struct config *cfg;
+	unsigned long gen;
+	struct retired *next;
+};
+
+static struct retired *retired = NULL;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// free the replaced configs no serving thread uses any more; never waits
+void config_reclaim(void)
+{
+	struct retired **p, *r;
+	unsigned long oldest = 0, gen;
+	int i;
+
+	if (__atomic_load_n(&retired, __ATOMIC_ACQUIRE) == NULL)
+		return;
+	pthread_mutex_lock(&retired_lock);
+	for (i = 0; i < MAX_READERS; i++) {
+		gen = __atomic_load_n(&readers[i], __ATOMIC_SEQ_CST);
+		if (gen != 0 && (oldest == 0 || gen < oldest))
+			oldest = gen;
+	}
+	p = &retired;
+	while ((r = *p) != NULL) {
+		if (oldest != 0 && oldest <= r->gen) {
+			p = &r->next;
+			continue;
+		}
+		*p = r->next;
+		config_free(r->cfg);
+		free(r);
+	}
+	pthread_mutex_unlock(&retired_lock);
+}
+
+// make cfg the current config; the old one is freed after a grace period
+void config_publish(struct config *cfg)
+{
+	struct config *old;
+	struct retired *r;
+
+	old = __atomic_exchange_n(&current, cfg, __ATOMIC_SEQ_CST);
+	if (old == NULL)
+		return;
+	if ((r = malloc(sizeof(*r))) == NULL) {
+		debugLog(LOG_WARNING, "config: out of memory, old config is leaked\n");
+		return;
+	}
+	r->cfg = old;
+	r->gen = __atomic_fetch_add(&current_gen, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&retired_lock);
+	r->next = retired;
+	__atomic_store_n(&retired, r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&retired_lock);
+	config_reclaim();
+}
+
+// give the calling thread a reader slot, returns -1 if none is left
+int config_register(void)
+{
+	int i;
+
+	pthread_mutex_lock(&register_lock);
+	for (i = 0; i < MAX_READERS; i++) {
+		if (!reader_used[i]) {
+			reader_used[i] = 1;
+			reader_slot = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&register_lock);
+	return reader_slot;
+}
+
+void config_unregister(void)
+{
+	if (reader_slot < 0)
+		return;
+	__atomic_store_n(&readers[reader_slot], 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&register_lock);
+	reader_used[reader_slot] = 0;
+	pthread_mutex_unlock(&register_lock);
+	reader_slot = -1;
+}
+
+// start using the current config; it stays valid until config_leave()
+const struct config *config_enter(void)
+{
+	if (reader_slot >= 0)
+		__atomic_store_n(&readers[reader_slot],
+				 __atomic_load_n(&current_gen, __ATOMIC_SEQ_CST),
+				 __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+}
+
+void config_leave(void)
+{
+	if (reader_slot >= 0)
+		__atomic_store_n(&readers[reader_slot], 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,93 @@
+/*
+ * config.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/types.h>
+
+#include "fritzident.h"
+
+#define CONFIG_FILE        "/etc/fritzident.conf"
+#define CONFIG_MAX_RANGES  32
+#define CONFIG_MAX_THREADS 64
+#define CONFIG_TIMEOUT     5000	/* ms to wait for the command */
+
+/* settings given on the command line, see struct config */
+#define CONFIG_CMDLINE_DOMAIN       0x0001
+#define CONFIG_CMDLINE_PREFETCH     0x0002
+#define CONFIG_CMDLINE_SNAPSHOT     0x0004	/* backend and snapshot_file */
+#define CONFIG_CMDLINE_SNAPSHOT_TTL 0x0008
+#define CONFIG_CMDLINE_NEGATIVE_TTL 0x0010
+#define CONFIG_CMDLINE_CLIENT_RATE  0x0020
+#define CONFIG_CMDLINE_CLIENT_BURST 0x0040
+#define CONFIG_CMDLINE_TRACE        0x0080
+#define CONFIG_CMDLINE_IO_URING     0x0100
+
+enum backend {
+	BACKEND_PROC,		/* scan /proc/net for every query */
+	BACKEND_SNAPSHOT	/* shared snapshot, see snapshot.h */
+};
+
+/* how ports that no cache knows are looked up, see strategy.h */
+enum lookup_strategy {
+	LOOKUP_AUTO,		/* the cheapest one as measured */
+	LOOKUP_PROC,		/* scan /proc/net up to the first match */
+	LOOKUP_NETLINK,		/* sock_diag dump filtered by the kernel */
+	LOOKUP_INDEX		/* hash of the whole table, shared by a burst */
+};
+
+/*
+ * Daemon configuration.  A config is never changed once it has been
+ * published; a reload builds a new one and swaps the pointer.  Serving
+ * threads bracket each connection with config_enter()/config_leave() and
+ * never wait for a reload.
+ */
+struct config {
+	char *domain;
+	int nranges;
+	struct {
+		uid_t min;
+		uid_t max;
+	} ranges[CONFIG_MAX_RANGES];
+	enum backend backend;
+	enum lookup_strategy lookup;
+	char *snapshot_file;
+	long snapshot_ttl;
+	int prefetch;
+	long negative_ttl;
+	double client_rate;
+	double client_burst;
+	long timeout;
+	int threads;
+	char *trace_file;	/* only read at startup */
+	long trace_slots;
+	int io_uring;		/* only read at startup */
+	unsigned int cmdline;	/* CONFIG_CMDLINE_* given, the file keeps them */
+
+	/* derived when the config is loaded */
+	fi_context *ctx;
+};
+
+void config_defaults(struct config *cfg);
+struct config *config_load(const char *path, const struct config *base);
+void config_free(struct config *cfg);
+
+void config_publish(struct config *cfg);
+void config_reclaim(void);
+int config_register(void);
+void config_unregister(void);
+const struct config *config_enter(void);
+void config_leave(void);
@@ -0,0 +1,292 @@
+/*
+ * fritzident.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <unistd.h>
+
+#include "fritzident.h"
+#include "netinfo.h"
+#include "userinfo.h"
+#include "capture.h"
+
+struct fi_context {
+	struct userinfo users;
+};
+
+/* getpwent() keeps one enumeration per process, even with the _r variant */
+static pthread_mutex_t pwent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* users come from this file instead of the system database if set */
+static const char *passwd_file = NULL;
+
+/* an entry larger than this is treated as an error, not grown for */
+#define PWBUF_MAX (1 << 20)
+
+/* buffer for the getpw*_r() strings, on the heap only for large entries */
+struct pwbuf {
+	char *data;
+	size_t size;
+	char local[1024];
+};
+
+fi_context *fi_context_new(void)
+{
+	return calloc(1, sizeof(fi_context));
+}
+
+void fi_context_free(fi_context *ctx)
+{
+	if (ctx == NULL)
+		return;
+	userinfo_free(&ctx->users);
+	free(ctx);
+}
+
+int fi_add_uid_range(fi_context *ctx, uid_t min, uid_t max)
+{
+	return add_uid_range(&ctx->users, min, max) ? 0 : -1;
+}
+
+int fi_set_domain(fi_context *ctx, const char *domain)
+{
+	return set_default_domain(&ctx->users, domain);
+}
+
+// look users up in a passwd format file, NULL for the system database;
+// not thread safe, call before the first lookup
+void fi_set_passwd_file(const char *path)
+{
+	passwd_file = path;
+}
+
+// sized as the system suggests
+static int pwbuf_init(struct pwbuf *b)
+{
+	long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+
+	b->data = b->local;
+	b->size = sizeof(b->local);
+	if (size > (long)sizeof(b->local)) {
+		if ((b->data = malloc(size)) == NULL)
+			return -1;
+		b->size = size;
+	}
+	return 0;
+}
+
+// double the buffer after ERANGE, -1 if it cannot grow any more
+static int pwbuf_grow(struct pwbuf *b)
+{
+	char *data;
+
+	if (b->size >= PWBUF_MAX)
+		return -1;
+	if ((data = malloc(b->size * 2)) == NULL)
+		return -1;
+	if (b->data != b->local)
+		free(b->data);
+	b->data = data;
+	b->size *= 2;
+	return 0;
+}
+
+static void pwbuf_free(struct pwbuf *b)
+{
+	if (b->data != b->local)
+		free(b->data);
+}
+
+// the next entry from file or from the system database, 0, ENOENT at the
+// end or an error; an entry that does not fit is read again (glibc keeps
+// the position on ERANGE) with a larger buffer
+static int next_user(FILE *file, struct passwd *pw, struct pwbuf *b,
+		     struct passwd **result)
+{
+	int rc;
+
+	do {
+		if (file)
+			rc = fgetpwent_r(file, pw, b->data, b->size, result);
+		else
+			rc = getpwent_r(pw, b->data, b->size, result);
+	} while (rc == ERANGE && pwbuf_grow(b) == 0);
+	return rc;
+}
+
+// the passwd entry of uid; *result is NULL if there is none
+static int find_user(uid_t uid, struct passwd *pw, struct pwbuf *b,
+		     struct passwd **result)
+{
+	FILE *file;
+	int rc;
+
+	if (passwd_file == NULL) {
+		while ((rc = getpwuid_r(uid, pw, b->data, b->size, result)) == ERANGE
+		       && pwbuf_grow(b) == 0)
+			;
+		return rc;
+	}
+	if ((file = fopen(passwd_file, "re")) == NULL)
+		return errno;
+	while ((rc = next_user(file, pw, b, result)) == 0 && (*result)->pw_uid != uid)
+		;
+	fclose(file);
+	if (rc != 0)
+		*result = NULL;
+	return rc == ENOENT ? 0 : rc;
+}
+
+// start an enumeration of all users, returns -1 if the file cannot be read
+static int users_begin(FILE **file, struct pwbuf *b)
+{
+	*file = NULL;
+	if (pwbuf_init(b) < 0)
+		return -1;
+	if (passwd_file && (*file = fopen(passwd_file, "re")) == NULL) {
+		pwbuf_free(b);
+		return -1;
+	}
+	pthread_mutex_lock(&pwent_lock);
+	if (*file == NULL)
+		setpwent();
+	return 0;
+}
+
+static void users_end(FILE *file, struct pwbuf *b)
+{
+	if (file)
+		fclose(file);
+	else
+		endpwent();
+	pthread_mutex_unlock(&pwent_lock);
+	pwbuf_free(b);
+}
+
+unsigned int fi_context_hash(const fi_context *ctx)
+{
+	return userinfo_hash(&ctx->users);
+}
+
+// owner of a local port, UID_NOT_FOUND ((uid_t)-1) if there is no such socket
+uid_t fi_port_uid(int proto, const char *ipv4, unsigned int port)
+{
+	if (proto == IPPROTO_TCP)
+		return ipv4_tcp_port_uid(ipv4, port);
+	if (proto == IPPROTO_UDP)
+		return ipv4_udp_port_uid(ipv4, port);
+	return UID_NOT_FOUND;
+}
+
+int fi_included_uid(const fi_context *ctx, uid_t uid)
+{
+	return included_uid(&ctx->users, uid);
+}
+
+const char *fi_qualify_name(const fi_context *ctx, const char *username,
+			    char *name, size_t len)
+{
+	return add_default_domain(&ctx->users, username, name, len);
+}
+
+// name of a user as sent to the Fritz!Box, NULL if unknown or too long
+const char *fi_user_identity(const fi_context *ctx, uid_t uid,
+			     char *name, size_t len)
+{
+	struct passwd pw, *result = NULL;
+	struct pwbuf b;
+	const char *identity = NULL;
+
+	if (pwbuf_init(&b) < 0)
+		return NULL;
+	if (find_user(uid, &pw, &b, &result) == 0 && result != NULL)
+		identity = add_default_domain(&ctx->users, pw.pw_name, name, len);
+	pwbuf_free(&b);
+	return identity;
+}
+
+enum fi_result fi_lookup(const fi_context *ctx, int proto, const char *ipv4,
+			 unsigned int port, char *name, size_t len)
+{
+	uid_t uid = fi_port_uid(proto, ipv4, port);
+
+	if (uid == UID_NOT_FOUND)
+		return FI_NOT_FOUND;
+	if (!included_uid(&ctx->users, uid))
+		return FI_SYSTEM_USER;
+	if (fi_user_identity(ctx, uid, name, len) == NULL)
+		return FI_ERROR;
+	return FI_USER;
+}
+
+// call back for every included user in passwd order, stops when the
+// callback returns non-zero; returns the number of users or -1
+int fi_users(const fi_context *ctx,
+	     int (*callback)(const struct fi_user *user, void *arg), void *arg)
+{
+	struct passwd pw, *result;
+	struct pwbuf b;
+	char name[FI_NAME_MAX];
+	struct fi_user user;
+	FILE *file;
+	int count = 0, rc;
+
+	if (users_begin(&file, &b) < 0)
+		return -1;
+	while ((rc = next_user(file, &pw, &b, &result)) == 0) {
+		if (!included_uid(&ctx->users, pw.pw_uid))
+			continue;
+		if (add_default_domain(&ctx->users, pw.pw_name, name, sizeof(name)) == NULL)
+			continue;
+		count++;
+		user.uid = pw.pw_uid;
+		user.name = name;
+		if (callback(&user, arg) != 0)
+			break;
+	}
+	users_end(file, &b);
+	/* a partial list is not passed off as all users */
+	return rc == 0 || rc == ENOENT ? count : -1;
+}
+
+// write the passwd entries of all included users to out, for a replay
+// through fi_set_passwd_file(); returns the number of users or -1
+int fi_write_passwd(const fi_context *ctx, FILE *out)
+{
+	struct passwd pw, *result;
+	struct pwbuf b;
+	FILE *file;
+	int count = 0, rc;
+
+	if (users_begin(&file, &b) < 0)
+		return -1;
+	while ((rc = next_user(file, &pw, &b, &result)) == 0) {
+		if (!included_uid(&ctx->users, pw.pw_uid))
+			continue;
+		if (putpwent(&pw, out) != 0)
+			break;
+		count++;
+	}
+	users_end(file, &b);
+	return rc == ENOENT ? count : -1;
+}
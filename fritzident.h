@@ -0,0 +1,69 @@
+/*
+ * fritzident.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * libfritzident - the lookups behind the AVM IDENT protocol.
+ *
+ * A context carries the uid ranges and the domain.  Set it up from one
+ * thread, afterwards all lookup functions may be called concurrently
+ * from any number of threads.  Protocols are given as IPPROTO_TCP or
+ * IPPROTO_UDP.
+ */
+#ifndef FRITZIDENT_H
+#define FRITZIDENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define FI_NAME_MAX 256	/* longest DOMAIN\user name returned */
+
+typedef struct fi_context fi_context;
+
+enum fi_result {
+	FI_USER,	/* port owned by an included user, name returned */
+	FI_SYSTEM_USER,	/* port owned by a user outside the uid ranges */
+	FI_NOT_FOUND,	/* no socket bound to this address and port */
+	FI_ERROR	/* owner has no passwd entry or name does not fit */
+};
+
+/* one included user as passed to the fi_users() callback */
+struct fi_user {
+	uid_t uid;
+	const char *name;	/* DOMAIN\user as sent */
+};
+
+fi_context *fi_context_new(void);
+void fi_context_free(fi_context *ctx);
+int fi_add_uid_range(fi_context *ctx, uid_t min, uid_t max);
+int fi_set_domain(fi_context *ctx, const char *domain);
+unsigned int fi_context_hash(const fi_context *ctx);
+
+uid_t fi_port_uid(int proto, const char *ipv4, unsigned int port);
+int fi_included_uid(const fi_context *ctx, uid_t uid);
+const char *fi_qualify_name(const fi_context *ctx, const char *username,
+			    char *name, size_t len);
+const char *fi_user_identity(const fi_context *ctx, uid_t uid,
+			     char *name, size_t len);
+enum fi_result fi_lookup(const fi_context *ctx, int proto, const char *ipv4,
+			 unsigned int port, char *name, size_t len);
+int fi_users(const fi_context *ctx,
+	     int (*callback)(const struct fi_user *user, void *arg), void *arg);
+
+#endif
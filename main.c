@@ -18,6 +18,7 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -29,25 +30,117 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#ifndef NO_LIBSYSTEMD
 #include <systemd/sd-daemon.h>
+#else
+#include <stddef.h>
+#include <sys/un.h>
+#endif
 
 
+#include "fritzident.h"
 #include "netinfo.h"
-#include "userinfo.h"
+#include "config.h"
+#include "prefetch.h"
+#include "snapshot.h"
+#include "negcache.h"
+#include "ratelimit.h"
+#include "upgrade.h"
+#include "reply.h"
+#include "trace.h"
+#include "stats.h"
+#include "strategy.h"
+#include "server.h"
+#include "uring.h"
 #include "debug.h"
 
 #define PORT 14013 /* Fritzident port */ 
-#define BUFFER 256
+#define MAX_LISTENERS 64 /* sockets passed by systemd we serve at most */
 
 void SocketServer();
+void InetdServer();
 void usage(const char *cmdname);
 
+#ifdef NO_LIBSYSTEMD
+/* minimal replacement for static builds without libsystemd */
+#define SD_LISTEN_FDS_START 3
+static int sd_listen_fds(int unset_environment)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    int n;
+
+    if (pid == NULL || fds == NULL || atoi(pid) != getpid())
+        return 0;
+    n = atoi(fds);
+    if (unset_environment) {
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+    }
+    return n > 0 ? n : 0;
+}
+
+static int sd_notify(int unset_environment, const char *state)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    socklen_t len;
+    int fd, rc;
+
+    if (path == NULL || (path[0] != '/' && path[0] != '@')
+        || strlen(path) >= sizeof(addr.sun_path))
+        return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';  /* abstract namespace */
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return -errno;
+    rc = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, len);
+    close(fd);
+    if (unset_environment)
+        unsetenv("NOTIFY_SOCKET");
+    return rc < 0 ? -errno : 1;
+}
+#endif
+
+static struct config base;  /* defaults and command line, the config file fills in the rest */
+static const char *config_file = CONFIG_FILE;
+static volatile sig_atomic_t dump_stats = 0;
+static volatile sig_atomic_t reload_config = 0;
+static volatile sig_atomic_t upgrade_binary = 0;
+static volatile sig_atomic_t draining = 0;  /* stopping or a new process took over: finish and exit */
+static char **saved_argv;
+static struct timespec start_time;  /* for the exec-to-answer time in inetd mode */
+
+/* shared by all serving threads */
+static struct pollfd listeners[MAX_LISTENERS];
+static int nlisteners = 0;
+static int worker_running[CONFIG_MAX_THREADS];
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static int uring_mode = 0;  /* one io_uring loop instead of the threads */
+static int inetd_mode = 0;  /* one connection, the config is loaded once its command is in */
+
 int main(int argc, char *argv[])
 {
     int c;
     int Port = PORT;  /* initializing port with default fritzident port */
-   
+    struct config *cfg;
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    saved_argv = argv;
    initLogging();
+    config_defaults(&base);
    
     while (1) {
         int option_index = 0;
@@ -55,11 +148,21 @@ int main(int argc, char *argv[])
             {"verbose",	no_argument, NULL, 'v'},
             {"domain",   required_argument, NULL, 'd'},
             {"port",   required_argument, NULL, 'p'},
+            {"prefetch",	no_argument, NULL, 'P'},
+            {"inetd",	no_argument, NULL, 'i'},
+            {"snapshot",	optional_argument, NULL, 's'},
+            {"snapshot-ttl",	required_argument, NULL, 256},
+            {"negative-ttl",	required_argument, NULL, 257},
+            {"client-rate",	required_argument, NULL, 258},
+            {"client-burst",	required_argument, NULL, 259},
+            {"config",	required_argument, NULL, 'c'},
+            {"trace",	required_argument, NULL, 260},
+            {"io-uring",	no_argument, NULL, 261},
             {"help",	no_argument, NULL, '?'},
             {0,		0,                 0,  0 }
         };
 
-        c = getopt_long(argc, argv, "vd:p:",
+        c = getopt_long(argc, argv, "vd:p:Pis::c:",
                         long_options, &option_index);
         if (c == -1)
             break;
@@ -69,217 +172,556 @@ int main(int argc, char *argv[])
 	  raiseVerbosity();
 	  break;
         case 'd':
-            set_default_domain(optarg);
+            free(base.domain);
+            base.domain = strdup(optarg);
+            base.cmdline |= CONFIG_CMDLINE_DOMAIN;
             break;
 	case 'p':
 	    Port = atoi(optarg);
 	    break;
+	case 'P':
+	    base.prefetch = 1;
+	    base.cmdline |= CONFIG_CMDLINE_PREFETCH;
+	    break;
+	case 'i':
+	    inetd_mode = 1;
+	    break;
+	case 's':
+	    base.backend = BACKEND_SNAPSHOT;
+	    free(base.snapshot_file);
+	    base.snapshot_file = strdup(optarg ? optarg : SNAPSHOT_PATH);
+	    base.cmdline |= CONFIG_CMDLINE_SNAPSHOT;
+	    break;
+	case 256:
+	    base.snapshot_ttl = atol(optarg);
+	    base.cmdline |= CONFIG_CMDLINE_SNAPSHOT_TTL;
+	    break;
+	case 257:
+	    base.negative_ttl = atol(optarg);
+	    base.cmdline |= CONFIG_CMDLINE_NEGATIVE_TTL;
+	    break;
+	case 258:
+	    base.client_rate = atof(optarg);
+	    base.cmdline |= CONFIG_CMDLINE_CLIENT_RATE;
+	    break;
+	case 259:
+	    base.client_burst = atof(optarg);
+	    base.cmdline |= CONFIG_CMDLINE_CLIENT_BURST;
+	    break;
+	case 'c':
+	    config_file = optarg;
+	    break;
+	case 260:
+	    free(base.trace_file);
+	    base.trace_file = strdup(optarg);
+	    base.cmdline |= CONFIG_CMDLINE_TRACE;
+	    break;
+	case 261:
+	    base.io_uring = 1;
+	    base.cmdline |= CONFIG_CMDLINE_IO_URING;
+	    break;
         case '?':
             usage(argv[0]);
             return 0;
         default:
             fprintf(stderr, "Unknown option\n");
-            fprintf(stderr, "Usage: fritzident [-v] [-p Port] [-d domain]\n");
+            fprintf(stderr, "Usage: fritzident [-v] [-i] [-P] [-s[file]] [-c config] [-p Port] [-d domain]\n");
             return 1;
         }
     }
 
-    add_uid_range (1000, 65533);
-    add_uid_range (65537,(uid_t) -1);
+    if (inetd_mode) {
+        InetdServer();
+        return 0;
+    }
+
+    if ((cfg = config_load(config_file, &base)) == NULL) {
+        fprintf(stderr, "Cannot load configuration %s\n", config_file);
+        return 1;
+    }
+    config_publish(cfg);
+    upgrade_resume();
+    if (cfg->trace_file) {
+        if (trace_open(cfg->trace_file, cfg->trace_slots) < 0) {
+            fprintf(stderr, "Cannot open trace file %s\n", cfg->trace_file);
+            return 1;
+        }
+        trace_capture(cfg);
+    }
 
     SocketServer(Port);
   
     return 0;
 }
 
-void sendResponse(int client_fd, const char *response, ...)
+/* inetd mode: set up what the answer needs once the command is in, so
+ * neither the banner nor a client that sends nothing waits for the file;
+ * the instances share the trace ring but do not capture */
+static const struct config *loadInetdConfig(void)
 {
-    char msg[BUFFER];
-    int n;
-    ssize_t nSent;
-    
-    va_list args;
-    va_start(args, response);
-    n = vsnprintf(msg, sizeof(msg), response, args);
-    va_end(args);
-
-    nSent = send(client_fd, msg, n+1, 0);
-    if(nSent < n+1){
-      debugLog(LOG_ERR, "Sending Response failed: %s", msg);
-      debugLog(LOG_ERR, "send: %s\n", strerror(errno));
-      exit(errno);
+    struct config *cfg;
+
+    if ((cfg = config_load(config_file, &base)) == NULL) {
+	debugLog(LOG_ERR, "Cannot load configuration %s\n", config_file);
+	return NULL;
     }
+    config_publish(cfg);
+    if (cfg->trace_file && trace_open(cfg->trace_file, cfg->trace_slots) < 0)
+	debugLog(LOG_ERR, "Cannot open trace file %s\n", cfg->trace_file);
+    return config_enter();
 }
 
-void execUSERS(int client_fd)
+/* answer a single connection: banner, one command, response, close */
+void serveConnection(int client_fd)
 {
-    struct passwd *userinfo = getpwent();
-    while (userinfo) {
-        if (included_uid(userinfo->pw_uid)) {
-	    debugLog(LOG_DEBUG, "USERS: %s\n", add_default_domain(userinfo->pw_name));
-            sendResponse(client_fd, "%s\r\n", add_default_domain(userinfo->pw_name));
-        }
-        userinfo = getpwent();
+    ssize_t bytes;
+    char cmd[BUFFER];
+    struct prefetch prefetch;
+    struct reply out;
+    struct request req;
+    const struct config *cfg = inetd_mode ? NULL : config_enter();
+    /* until the config is loaded only the command line applies */
+    const struct config *early = cfg ? cfg : &base;
+
+    /* in inetd mode the trace ring is only opened with the config */
+    startRequest(&req, cfg == NULL || trace_enabled());
+    memset(&prefetch, 0, sizeof(prefetch));
+    if (early->prefetch)
+	prefetch_start(&prefetch);
+    if (early->timeout > 0) {
+	struct timeval tv;
+	tv.tv_sec = early->timeout / 1000;
+	tv.tv_usec = (early->timeout % 1000) * 1000;
+	setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
     }
-    endpwent();
+
+    /* the Fritz!Box waits for the banner before it sends the command,
+     * so this is the one part that cannot share a send with the answer */
+    reply_init(&out, client_fd);
+    reply_line(&out, "AVM IDENT", NULL);
+    if (reply_flush(&out) < 0)
+	bytes = -1;
+    else {
+	traceStage(&req, TRACE_BANNER);
+	/* wait for data */
+	bzero(&cmd, sizeof(cmd));
+	bytes = recv(client_fd, cmd, sizeof(cmd)-1, 0);
+	traceStage(&req, TRACE_WAIT);
+    }
+
+    if(bytes <= 0) {
+	if (bytes < 0 && !out.failed)
+	    debugLog(LOG_NOTICE, "recv: %s\n", strerror(errno));
+	trace_write(&req.rec);
+	prefetch_discard(&prefetch);
+	close(client_fd);
+	config_leave();
+	return;
+    }
+
+    if (cfg == NULL) {
+	if ((cfg = loadInetdConfig()) == NULL) {
+	    prefetch_discard(&prefetch);
+	    close(client_fd);
+	    return;
+	}
+	/* charged to the wait, so the lookup times compare with the daemon's */
+	traceStage(&req, TRACE_WAIT);
+    }
+
+    cmd[bytes] = '\0';
+    answerCommand(cfg, &prefetch, &req, &out, cmd);
+    reply_flush(&out);
+    traceStage(&req, TRACE_SEND);
+    trace_write(&req.rec);
+    /* Close data connection */
+    prefetch_discard(&prefetch);
+    close(client_fd);
+    config_leave();
+}
+
+/*
+ * Per-connection mode: inetd hands over the connection on stdin, systemd
+ * with Accept=yes passes it as the first listen fd.  Nothing is set up
+ * beyond what answering this one command needs.
+ */
+void InetdServer()
+{
+    struct timespec now;
+    int client_fd = STDIN_FILENO;
+
+    if (sd_listen_fds(1) >= 1)
+        client_fd = SD_LISTEN_FDS_START + 0;
+
+    serveConnection(client_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    debugLog(LOG_INFO, "Answered %ld us after start\n",
+	     stats_elapsed_us(&start_time, &now));
 }
 
-void execTCP(int client_fd, const char *ipv4, const char *port)
+/* returns true if fd is a listening socket, false for a connection */
+static int is_listening(int fd)
 {
-    unsigned int portNumber;
-    uid_t uid;
-    sscanf(port, "%u", &portNumber);
-    uid = ipv4_tcp_port_uid(ipv4, portNumber);
-    if (uid != UID_NOT_FOUND) {
-        if (included_uid(uid)) {
-            struct passwd *user;
-            user = getpwuid(uid);
-            debugLog(LOG_DEBUG, "TCP %s: %s\n", port, user->pw_name);
-            sendResponse(client_fd, "USER %s\r\n", add_default_domain(user->pw_name));
-        }
-        else
-            sendResponse(client_fd, "ERROR SYSTEM_USER\r\n");
+    int val = 0;
+    socklen_t len = sizeof(val);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) < 0)
+        return 1;
+    return val;
+}
+
+static void handle_signal(int sig)
+{
+    if (sig == SIGUSR1)
+        dump_stats = 1;
+    else if (sig == SIGHUP)
+        reload_config = 1;
+    else if (sig == SIGUSR2)
+        upgrade_binary = 1;
+    else if (sig == SIGTERM || sig == SIGINT)
+        draining = 1;
+}
+
+static void *serveLoop(void *arg);
+
+/* start the serving threads the config asks for that are not running yet */
+static void adjustWorkers(int threads)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    long slot;
+
+    /* the io_uring loop serves everything from the main thread */
+    if (uring_mode)
+	return;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_mutex_lock(&workers_lock);
+    /* slot 0 is the main thread */
+    for (slot = 1; slot < threads; slot++) {
+	if (worker_running[slot])
+	    continue;
+	if (pthread_create(&thread, &attr, serveLoop, (void *)slot) != 0) {
+	    debugLog(LOG_WARNING, "Cannot start serving thread %ld\n", slot);
+	    break;
+	}
+	worker_running[slot] = 1;
     }
-    else {
-        sendResponse(client_fd, "ERROR NOT_FOUND\r\n");
+    pthread_mutex_unlock(&workers_lock);
+    pthread_attr_destroy(&attr);
+}
+
+/* SIGHUP: build a new config and swap it in; serving threads keep going
+ * with the config they started their connection with */
+static void reloadConfig(void)
+{
+    struct config *cfg;
+
+    pthread_mutex_lock(&reload_lock);
+    cfg = config_load(config_file, &base);
+    if (cfg) {
+	config_publish(cfg);
+	debugLog(LOG_NOTICE, "Configuration reloaded\n");
+	adjustWorkers(cfg->threads);
     }
+    else
+	debugLog(LOG_ERR, "Configuration not reloaded, keeping the old one\n");
+    pthread_mutex_unlock(&reload_lock);
 }
 
-void execUDP(int client_fd, const char *ipv4, const char *port)
+/* SIGUSR2: start the binary again and hand over the listeners and caches;
+ * this process keeps serving until upgradeDone() sees the new one serve */
+static void upgradeDaemon(void)
 {
-    unsigned int portNumber;
-    uid_t uid;
-    sscanf(port, "%u", &portNumber);
-    uid = ipv4_udp_port_uid(ipv4, portNumber);
-    if (uid != UID_NOT_FOUND) {
-        if (included_uid(uid)) {
-            struct passwd *user;
-            user = getpwuid(uid);
-            debugLog(LOG_DEBUG, "UDP %s: %s\n", port, user->pw_name);
-            sendResponse(client_fd, "USER %s\r\n", add_default_domain(user->pw_name));
-        }
-        else
-            sendResponse(client_fd, "ERROR SYSTEM_USER\r\n");
+    int fds[MAX_LISTENERS];
+    pid_t pid;
+    int i;
+
+    pthread_mutex_lock(&reload_lock);
+    if (!__atomic_load_n(&draining, __ATOMIC_SEQ_CST) && !upgrade_pending()) {
+	for (i = 0; i < nlisteners; i++)
+	    fds[i] = listeners[i].fd;
+	pid = upgrade_exec(saved_argv, fds, nlisteners);
+	if (pid > 0)
+	    debugLog(LOG_INFO, "Process %d starting\n", (int)pid);
     }
-    else {
-        sendResponse(client_fd, "ERROR NOT_FOUND\r\n");
+    pthread_mutex_unlock(&reload_lock);
+}
+
+/* drain once the new process serves */
+static void upgradeDone(void)
+{
+    char state[32];
+    pid_t pid;
+
+    pthread_mutex_lock(&reload_lock);
+    pid = upgrade_poll();
+    if (pid > 0) {
+	debugLog(LOG_NOTICE, "Process %d took over, draining\n", (int)pid);
+	snprintf(state, sizeof(state), "MAINPID=%d", (int)pid);
+	sd_notify(0, state);
+	__atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
     }
+    pthread_mutex_unlock(&reload_lock);
 }
 
+/* act on the signals that arrived since the last call; every serving
+ * loop runs this at least once a second */
+void serverHousekeeping(void)
+{
+    const struct config *cfg;
+    int mask;
 
-void SocketServer(int Port)
+    if (__atomic_exchange_n(&dump_stats, 0, __ATOMIC_SEQ_CST)) {
+	/* asked for, so shown even without -v; with tracing on, also save
+	 * the tables that go with the trace */
+	mask = setlogmask(0);
+	setlogmask(mask | LOG_MASK(LOG_NOTICE));
+	stats_log();
+	strategy_log();
+	setlogmask(mask);
+	cfg = config_enter();
+	trace_capture(cfg);
+	config_leave();
+    }
+    if (__atomic_exchange_n(&reload_config, 0, __ATOMIC_SEQ_CST))
+	reloadConfig();
+    if (__atomic_exchange_n(&upgrade_binary, 0, __ATOMIC_SEQ_CST))
+	upgradeDaemon();
+    if (upgrade_pending())
+	upgradeDone();
+    /* configs replaced by a reload, once no connection uses them */
+    config_reclaim();
+}
+
+/* true once the daemon stops accepting and only finishes what it has */
+int serverDraining(void)
 {
-    int socket_fd;
-    int client_fd;
-    struct sockaddr_in self;
-    struct sockaddr_in client_addr;
-    socklen_t addrlen = sizeof(client_addr);
-    ssize_t bytes;
-    char cmd[BUFFER];
-    int n;
+    return __atomic_load_n(&draining, __ATOMIC_SEQ_CST);
+}
 
-    n = sd_listen_fds(0); /* number of file descriptors passed by systemd */
+/* returns true if this worker is no longer wanted and has to exit */
+static int workerRetired(long slot)
+{
+    const struct config *cfg;
+    int retired;
 
-    /* debugLog("Got %i file descriptors from systemd", n); */
-    if (n > 1) {
-	    debugLog(LOG_ERR, "Too many file descriptors received.\n");
-	    exit(1);
-    } else if(n == 1){
-	    debugLog(LOG_DEBUG, "Socket passed by systemd");
-	    socket_fd = SD_LISTEN_FDS_START + 0;
+    if (slot == 0)
+	return __atomic_load_n(&draining, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&workers_lock);
+    cfg = config_enter();
+    retired = slot >= cfg->threads || __atomic_load_n(&draining, __ATOMIC_SEQ_CST);
+    config_leave();
+    if (retired)
+	worker_running[slot] = 0;
+    pthread_mutex_unlock(&workers_lock);
+    return retired;
+}
+
+/* the accept loop, run by the main thread and every worker thread */
+static void *serveLoop(void *arg)
+{
+    long slot = (long)arg;
+    int client_fd;
+    struct sockaddr_storage client_addr;
+    socklen_t addrlen;
+    const struct config *cfg;
+    double rate, burst;
+    int i;
+
+    if (config_register() < 0) {
+	debugLog(LOG_ERR, "Too many serving threads\n");
+	exit(1);
     }
-    else {
-      debugLog(LOG_INFO, "Creating socket\n");
-      if((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-	debugLog(LOG_ERR, "socket: %s\n", strerror(errno));
+
+    /* Infinite loop */
+    while (!workerRetired(slot)) {
+      /* Await a connection on any of the listeners; wake up now and then
+       * to pick up signals that were delivered to other threads */
+      serverHousekeeping();
+      if (poll(listeners, nlisteners, 1000) < 0) {
+	if (errno == EINTR)
+	  continue;
+	debugLog(LOG_ERR, "poll: %s\n", strerror(errno));
 	exit(errno);
       }
+      /* after a handoff the backlog belongs to the new process */
+      if (serverDraining())
+	continue;
 
-      bzero(&self, sizeof(self));
-      self.sin_family = AF_INET;
-      self.sin_port = htons(Port);
-      self.sin_addr.s_addr = INADDR_ANY;
+      for (i = 0; i < nlisteners; i++) {
+	if (!(listeners[i].revents & POLLIN))
+	  continue;
+	addrlen = sizeof(client_addr);
+	/* an upgrade may exec while other threads hold clients */
+	client_fd = accept4(listeners[i].fd, (struct sockaddr*) &client_addr, &addrlen,
+			    SOCK_CLOEXEC);
+	if(client_fd < 0){
+	  if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK
+	      || errno == ECONNABORTED)
+	    continue;
+	  debugLog(LOG_ERR, "accept connection failed: %s\n", strerror(errno));
+	  exit(errno);
+	}
+	/* throttled peers are dropped before any lookup work */
+	cfg = config_enter();
+	rate = cfg->client_rate;
+	burst = cfg->client_burst;
+	config_leave();
+	if (!ratelimit_admit(rate, burst, (struct sockaddr*) &client_addr)) {
+	  close(client_fd);
+	  continue;
+	}
+	serveConnection(client_fd);
+      }
+    }
+    config_unregister();
+    return NULL;
+}
 
-      debugLog(LOG_INFO, "Binding port to socket\n");
-      if(bind(socket_fd, (struct sockaddr*) &self, sizeof(self)) != 0 ) {
-	debugLog(LOG_ERR, "bind: %s\n", strerror(errno));
+/*
+ * Create the standalone listening socket.  An IPv6 socket with IPV6_V6ONLY
+ * cleared accepts IPv4 connections as well; hosts without IPv6 get a plain
+ * IPv4 socket.
+ */
+int openListener(int Port)
+{
+    int socket_fd;
+    int off = 0, on = 1;
+    struct sockaddr_in6 self6;
+    struct sockaddr_in self;
+
+    debugLog(LOG_INFO, "Creating socket\n");
+    if ((socket_fd = socket(AF_INET6, SOCK_STREAM, 0)) >= 0) {
+	setsockopt(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	/* connections we closed linger in TIME_WAIT, do not let them block a restart */
+	setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	bzero(&self6, sizeof(self6));
+	self6.sin6_family = AF_INET6;
+	self6.sin6_port = htons(Port);
+	self6.sin6_addr = in6addr_any;
+
+	debugLog(LOG_INFO, "Binding port to dual-stack socket\n");
+	if (bind(socket_fd, (struct sockaddr*) &self6, sizeof(self6)) != 0) {
+	    debugLog(LOG_ERR, "bind: %s\n", strerror(errno));
+	    exit(errno);
+	}
+    }
+    else if (errno == EAFNOSUPPORT) {
+	if((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	    debugLog(LOG_ERR, "socket: %s\n", strerror(errno));
+	    exit(errno);
+	}
+	setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	bzero(&self, sizeof(self));
+	self.sin_family = AF_INET;
+	self.sin_port = htons(Port);
+	self.sin_addr.s_addr = INADDR_ANY;
+
+	debugLog(LOG_INFO, "Binding port to socket\n");
+	if(bind(socket_fd, (struct sockaddr*) &self, sizeof(self)) != 0 ) {
+	    debugLog(LOG_ERR, "bind: %s\n", strerror(errno));
+	    exit(errno);
+	}
+    }
+    else {
+	debugLog(LOG_ERR, "socket: %s\n", strerror(errno));
 	exit(errno);
-      }
+    }
 
-      /* Make it a "listening socket" */
-      if (listen(socket_fd, 20) != 0) {
+    /* Make it a "listening socket" */
+    if (listen(socket_fd, 20) != 0) {
 	debugLog(LOG_ERR, "listen: %s\n", strerror(errno));
 	exit(errno);
-      }
     }
+    return socket_fd;
+}
 
-    debugLog(LOG_INFO, "fritzident daemon started om port %i\n", Port);
+void SocketServer(int Port)
+{
+    int i, n, uring;
+    int fds[MAX_LISTENERS];
+    struct sigaction sa;
+    const struct config *cfg;
+    struct timespec pause = { 0, 10000000 };
 
-    /* Infinite loop */
-    while (1) {
-      /* Bind port to socket */
-      /* Await a connection on socket_fd*/
-
-      /* debugLog("Waiting for connection from fritz!box...\n"); */
-      client_fd = accept(socket_fd, (struct sockaddr*) &client_addr, &addrlen);
-      if(client_fd < 0){
-	debugLog(LOG_ERR, "accept %s:%d connection failed: %s\n",
-		 inet_ntoa(client_addr.sin_addr),
-		 ntohs(client_addr.sin_port),
-		 strerror(errno));
-	exit(errno);
-      }
-      
-      bytes = send(client_fd, "AVM IDENT\r\n", strlen("AVM IDENT\r\n")+1, 0);
-      if(bytes < 0) {
-	debugLog(LOG_ERR, "Sending \"AVM IDENT\" failed!");
-	exit(-1);
-      }
+    /* SIGUSR1 dumps the statistics, SIGHUP reloads the configuration,
+     * SIGUSR2 re-executes the binary, SIGTERM finishes the connections in
+     * progress and exits; no SA_RESTART so poll() wakes up */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
 
-      /* wait for data */
-      bzero(&cmd, sizeof(cmd));
-      bytes = recv(client_fd, cmd, sizeof(cmd)-1, 0);
+    n = sd_listen_fds(0); /* number of file descriptors passed by systemd */
 
-      if(bytes == 0) continue;
-      else if(bytes < 0){
-	debugLog(LOG_ERR, "recv: %s\n", strerror(errno));
-	exit(errno);
-      }
+    /* debugLog("Got %i file descriptors from systemd", n); */
+    if (n == 1 && !is_listening(SD_LISTEN_FDS_START)) {
+	/* started from a socket unit with Accept=yes */
+	InetdServer();
+	return;
+    }
+    if (n > MAX_LISTENERS) {
+	debugLog(LOG_WARNING, "Got %i sockets, serving only the first %i\n", n, MAX_LISTENERS);
+	n = MAX_LISTENERS;
+    }
+    for (i = 0; i < n; i++) {
+	listeners[nlisteners++].fd = SD_LISTEN_FDS_START + i;
+    }
+    if (n > 0)
+	debugLog(LOG_DEBUG, "%i socket(s) passed by systemd", n);
+    else
+	listeners[nlisteners++].fd = openListener(Port);
 
-      cmd[bytes] = '\0';
-      /* the first token is containing the command which might be
-       * USERS, TCP, or UDP and is usually seperated by spaces */
-      char *cmdVerb = strtok(cmd, "\r\n ");
+    /* all listeners and threads share one loop; accept() must not block
+     * if another thread or a queued reset emptied the backlog meanwhile;
+     * upgrades pass them on explicitly */
+    for (i = 0; i < nlisteners; i++) {
+	fcntl(listeners[i].fd, F_SETFL, fcntl(listeners[i].fd, F_GETFL) | O_NONBLOCK);
+	fcntl(listeners[i].fd, F_SETFD, FD_CLOEXEC);
+	listeners[i].events = POLLIN;
+    }
 
-      /* debugLog("Received command: \"%s\"\n", cmdVerb); */
-      if (strcmp(cmdVerb, "USERS") == 0) {
-	execUSERS(client_fd);
-      }
-      else if (strcmp(cmdVerb, "TCP") == 0) {
-	char *localIp = strtok(NULL, ":");
-	char *localPort = strtok(NULL, "\r\n");
-	debugLog(LOG_DEBUG, "Searching for \"%s:%s\"\n", localIp, localPort);
-	if(localIp != NULL && localPort != NULL)
-	  execTCP(client_fd, localIp, localPort);
-	else sendResponse(client_fd, "ERROR UNSPECIFIED\r\n");
-      }
-      else if (strcmp(cmdVerb, "UDP") == 0) {
-	char *localIp = strtok(NULL, ":");
-	char *localPort = strtok(NULL, "\r\n");
-	debugLog(LOG_DEBUG, "Searching for \"%s:%s\"\n", localIp, localPort);
-	if(localIp != NULL && localPort != NULL)
-	  execUDP(client_fd, localIp, localPort);
-	else sendResponse(client_fd, "ERROR UNSPECIFIED\r\n");
-      } else {
-	debugLog(LOG_NOTICE, "Unrecognized command \"%s\"\n", cmd);
-	sendResponse(client_fd, "ERROR UNSPECIFIED\r\n");
-      }
-      /* Close data connection */
-      close(client_fd);
+    debugLog(LOG_INFO, "fritzident daemon started om port %i\n", Port);
+
+    cfg = config_enter();
+    n = cfg->threads;
+    uring = cfg->io_uring;
+    config_leave();
+    if (uring) {
+	for (i = 0; i < nlisteners; i++)
+	    fds[i] = listeners[i].fd;
+	/* kernels without io_uring get the threads instead */
+	uring_mode = uring_open(fds, nlisteners) == 0;
+    }
+    adjustWorkers(n);
+    upgrade_ready();
+    if (uring_mode)
+	uring_serve();
+    else
+	serveLoop((void *)0L);
+
+    /* draining: wait until the other threads finished their connections */
+    for (;;) {
+	pthread_mutex_lock(&workers_lock);
+	for (i = 1; i < CONFIG_MAX_THREADS && !worker_running[i]; i++)
+	    ;
+	pthread_mutex_unlock(&workers_lock);
+	if (i == CONFIG_MAX_THREADS)
+	    break;
+	nanosleep(&pause, NULL);
     }
+    debugLog(LOG_INFO, "fritzident daemon drained, exiting\n");
 
     /* Finally some housekeeping */
-    close(socket_fd);
+    for (i = 0; i < nlisteners; i++)
+	close(listeners[i].fd);
 }
 
 void usage(const char *cmdname)
@@ -290,7 +732,17 @@ void usage(const char *cmdname)
     printf("Options:\n");
     printf("\t-v increase verbosity (may be assed multiple times.\n");
     printf("\t-p Port to listen on if not 14013 (for debugging only)\n");
+    printf("\t-P read the socket tables while waiting for the command\n");
+    printf("\t-i answer one connection on stdin and exit (inetd, systemd Accept=yes)\n");
+    printf("\t-s[file] share socket and user data with other instances (default %s)\n", SNAPSHOT_PATH);
+    printf("\t--snapshot-ttl ms ... rebuild the shared data after ms milliseconds\n");
+    printf("\t--negative-ttl ms ... remember ports that were not found (default %d, 0 = off)\n", NEGCACHE_TTL);
+    printf("\t--client-rate n ..... accept n connections per second and client (default off)\n");
+    printf("\t--client-burst n .... allow bursts of n connections per client\n");
     printf("\t-d domain ...... fake a Windows domain\n");
+    printf("\t-c file ........ read the configuration from file (default %s)\n", CONFIG_FILE);
+    printf("\t--trace file ... record every request in a ring buffer file\n");
+    printf("\t--io-uring ..... serve through io_uring if the kernel has it\n");
     printf("\nLICENSE:\n");
     printf("This utility is provided under the GNU GENERAL PUBLIC LICENSE v3.0\n(see http://www.gnu.org/licenses/gpl-3.0.txt)\n");
 }
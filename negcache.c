@@ -0,0 +1,123 @@
+/*
+ * negcache.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "netinfo.h"
+#include "negcache.h"
+#include "stats.h"
+
+struct negcache_entry {
+	uint32_t addr;
+	uint16_t port;
+	uint8_t proto;
+	uint64_t expires;	/* ms, CLOCK_MONOTONIC; 0 marks an empty slot */
+};
+
+static struct negcache_entry negcache[NEGCACHE_SLOTS];
+static pthread_mutex_t negcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static struct negcache_entry *negcache_slot(int proto, uint32_t addr, unsigned int port)
+{
+	uint32_t h = (addr ^ (port << 8 | proto)) * 2654435761u;
+	return &negcache[(h >> 16) & (NEGCACHE_SLOTS - 1)];
+}
+
+// true if the port was not found less than ttl_ms ago
+// like negcache_hit(), but not counted: for callers that only plan ahead
+int negcache_known(long ttl_ms, int proto, const char *ipv4, unsigned int port)
+{
+	uint32_t addr = ipv4_procaddr(ipv4);
+	struct negcache_entry *e;
+	int hit;
+
+	if (ttl_ms <= 0)
+		return 0;
+	e = negcache_slot(proto, addr, port);
+	pthread_mutex_lock(&negcache_lock);
+	hit = e->expires && e->addr == addr && e->port == port && e->proto == proto
+		&& now_ms() < e->expires;
+	pthread_mutex_unlock(&negcache_lock);
+	return hit;
+}
+
+int negcache_hit(long ttl_ms, int proto, const char *ipv4, unsigned int port)
+{
+	int hit = negcache_known(ttl_ms, proto, ipv4, port);
+
+	if (hit)
+		stats_inc(STAT_NEGCACHE_HITS);
+	return hit;
+}
+
+void negcache_add(long ttl_ms, int proto, const char *ipv4, unsigned int port)
+{
+	uint32_t addr = ipv4_procaddr(ipv4);
+	struct negcache_entry *e;
+
+	if (ttl_ms <= 0)
+		return;
+	e = negcache_slot(proto, addr, port);
+	pthread_mutex_lock(&negcache_lock);
+	e->addr = addr;
+	e->port = port;
+	e->proto = proto;
+	e->expires = now_ms() + ttl_ms;
+	pthread_mutex_unlock(&negcache_lock);
+}
+
+/*
+ * The table is handed to the next process on an upgrade.  Expiry times are
+ * CLOCK_MONOTONIC, which is the same for every process on the host.
+ */
+int negcache_save(FILE *file)
+{
+	uint32_t slots = NEGCACHE_SLOTS;
+	size_t n;
+
+	pthread_mutex_lock(&negcache_lock);
+	n = fwrite(&slots, sizeof(slots), 1, file)
+		+ fwrite(negcache, sizeof(negcache), 1, file);
+	pthread_mutex_unlock(&negcache_lock);
+	return n == 2 ? 0 : -1;
+}
+
+int negcache_load(FILE *file)
+{
+	static struct negcache_entry saved[NEGCACHE_SLOTS];
+	uint32_t slots;
+
+	if (fread(&slots, sizeof(slots), 1, file) != 1 || slots != NEGCACHE_SLOTS
+	    || fread(saved, sizeof(saved), 1, file) != 1)
+		return -1;
+	pthread_mutex_lock(&negcache_lock);
+	memcpy(negcache, saved, sizeof(negcache));
+	pthread_mutex_unlock(&negcache_lock);
+	return 0;
+}
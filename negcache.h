@@ -0,0 +1,33 @@
+/*
+ * negcache.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+/*
+ * Short-lived cache of ports that were not found, so repeated queries for
+ * nonexistent ports do not scan /proc every time.
+ */
+#define NEGCACHE_TTL   1000	/* default ms, 0 disables the cache */
+#define NEGCACHE_SLOTS 1024	/* direct mapped, power of two */
+
+int negcache_known(long ttl_ms, int proto, const char *ipv4, unsigned int port);
+int negcache_hit(long ttl_ms, int proto, const char *ipv4, unsigned int port);
+void negcache_add(long ttl_ms, int proto, const char *ipv4, unsigned int port);
+int negcache_save(FILE *file);
+int negcache_load(FILE *file);
@@ -18,7 +18,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -26,95 +31,220 @@
 #include <arpa/inet.h>
 #include <syslog.h>
 
+#include "fritzident.h"
 #include "netinfo.h"
+#include "capture.h"
 
 #include "debug.h"
 
-#define IPV4_TCP_PORTS  "/proc/net/tcp"
-#define IPV4_UDP_PORTS  "/proc/net/udp"
-#define IPV6_TCP_PORTS  "/proc/net/tcp6"
-#define IPV6_UDP_PORTS  "/proc/net/udp6"
+/* the live tables unless a replay points the lookups at captured copies */
+static const char *tcp_path = IPV4_TCP_PORTS;
+static const char *udp_path = IPV4_UDP_PORTS;
 
-// convert an IPv4 address & port number to a hex string in the format
-//  B0B1B2B3:PORT
-// with Bx representing the IP address in host byte order
-// the string is returned in a static buffer, which is overwritten at every call
-const char *ipv4_bindstring(const char *ipv4, unsigned int port)
+// read the IPv4 tables from these files from now on; not thread safe,
+// call before the first lookup
+void ipv4_set_table_paths(const char *tcp, const char *udp)
+{
+	tcp_path = tcp;
+	udp_path = udp;
+}
+
+// true if the tables are the live ones, which other sources such as
+// sock_diag also show
+int ipv4_tables_live(void)
+{
+	return strcmp(tcp_path, IPV4_TCP_PORTS) == 0 && strcmp(udp_path, IPV4_UDP_PORTS) == 0;
+}
+
+// convert a dotted IPv4 address to the binary form used in /proc/net
+uint32_t ipv4_procaddr(const char *ipv4)
 {
-	static char buffer[32];
 	union {
 		uint8_t b[4];
 		uint32_t bin;
 	} ip_s;
 
+	ip_s.bin = 0;
 	sscanf(ipv4, "%hhu.%hhu.%hhu.%hhu",
 	       &(ip_s.b[0]), &(ip_s.b[1]), &(ip_s.b[2]), &(ip_s.b[3]));
+	return ip_s.bin;
+}
 
-	sprintf(buffer, "%08X:%04X", ip_s.bin, port);
+// convert an IPv4 address & port number to a hex string in the format
+//  B0B1B2B3:PORT
+// with Bx representing the IP address in host byte order
+// the string is written to buffer, which must hold BINDSTRING_LEN bytes
+char *ipv4_bindstring(const char *ipv4, unsigned int port, char *buffer)
+{
+	snprintf(buffer, BINDSTRING_LEN, "%08X:%04X", ipv4_procaddr(ipv4), port);
 
 	debugLog(LOG_DEBUG, "Bindstring \"%s\"\n", buffer);
 	return buffer;
 }
 
-		
-// find the UID associated with a specific local ipv4 TCP port
-uid_t ipv4_tcp_port_uid(const char *ipv4, unsigned int port)
+// find the UID associated with a local port in one of the /proc/net tables
+static uid_t proc_port_uid(const char *path, const char *ipv4, unsigned int port)
 {
 	char buffer[1024];
-	const char *bindstring = ipv4_bindstring(ipv4, port);
-
-	FILE *portlist=fopen(IPV4_TCP_PORTS, "r");
-	while (fgets(buffer, 1024, portlist)) {
-	    char *uid;
-	    char *field=strtok(buffer, " ");        // INDEX (ignored)
-	    char *local=field=strtok(NULL, " ");    // LOCAL ADDRESS
-	    field=strtok(NULL, " ");                // (ignored)
-	    field=strtok(NULL, " ");                // (ignored)
-	    field=strtok(NULL, " ");                // (ignored)
-	    field=strtok(NULL, " ");                // (ignored)
-	    field=strtok(NULL, " ");                // (ignored)
-	    uid=strtok(NULL, " ");                  // UID
-	    if (strcmp(local, bindstring)==0) {
-            unsigned long id;
-            sscanf(uid, "%lu", &id);
-	    debugLog(LOG_DEBUG, "Found UID=%lu\n", id);
-	    fclose(portlist);
-            return (uid_t)id;
+	char bindstring[BINDSTRING_LEN];
+	FILE *portlist;
+
+	ipv4_bindstring(ipv4, port, bindstring);
+	if ((portlist = fopen(path, "re")) == NULL) {
+	    debugLog(LOG_ERR, "%s: %s\n", path, strerror(errno));
+	    return UID_NOT_FOUND;
+	}
+	while (fgets(buffer, sizeof(buffer), portlist)) {
+	    char local[BINDSTRING_LEN];
+	    unsigned long id;
+	    // INDEX, LOCAL ADDRESS, 5 ignored fields, UID
+	    if (sscanf(buffer, "%*s %31s %*s %*s %*s %*s %*s %lu", local, &id) == 2
+		&& strcmp(local, bindstring) == 0) {
+		debugLog(LOG_DEBUG, "Found UID=%lu\n", id);
+		fclose(portlist);
+		return (uid_t)id;
 	    }
 	}
 	fclose(portlist);
-	debugLog(LOG_NOTICE, "UID fpr UDP Port %i Not found\n", port);
 	return UID_NOT_FOUND;
 }
 
+// find the UID associated with a specific local ipv4 TCP port
+uid_t ipv4_tcp_port_uid(const char *ipv4, unsigned int port)
+{
+	uid_t uid = proc_port_uid(tcp_path, ipv4, port);
+	if (uid == UID_NOT_FOUND)
+	    debugLog(LOG_NOTICE, "UID for TCP port %i Not found\n", port);
+	return uid;
+}
+
 // find the UID associated with a specific local ipv4 UDP port
 uid_t ipv4_udp_port_uid(const char *ipv4, unsigned int port)
 {
-	char buffer[1024];
-	const char *bindstring = ipv4_bindstring(ipv4, port);
-
-	FILE *portlist=fopen(IPV4_UDP_PORTS, "r");
-	while (fgets(buffer, 1024, portlist)) {
-	    char *uid;
-	    char *field=strtok(buffer, " ");        // INDEX (ignored)
-	    char *local=field=strtok(NULL, " ");    // LOCAL ADDRESS
-	    field=strtok(NULL, " ");                // (ignored)
-	    field=strtok(NULL, " ");                // (ignored)
-	    field=strtok(NULL, " ");                // (ignored)
-	    field=strtok(NULL, " ");                // (ignored)
-	    field=strtok(NULL, " ");                // (ignored)
-	    uid=strtok(NULL, " ");                  // UID
-	    if (strcmp(local, bindstring)==0) {
-            unsigned long id;
-            sscanf(uid, "%lu", &id);
-	    debugLog(LOG_DEBUG, "Found UID=%lu\n", id);
-	    fclose(portlist);
-            return (uid_t)id;
+	uid_t uid = proc_port_uid(udp_path, ipv4, port);
+	if (uid == UID_NOT_FOUND)
+	    debugLog(LOG_NOTICE, "UID for UDP port %i Not found\n", port);
+	return uid;
+}
+
+// read a complete /proc/net table (or a saved copy) into memory, returns 0 on success
+int port_table_load(struct port_table *table, const char *path)
+{
+	size_t size = 16384;
+	ssize_t n;
+	int fd;
+
+	table->data = NULL;
+	table->len = 0;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	table->data = malloc(size);
+	while (table->data) {
+		if (table->len + 1 >= size) {
+			char *bigger = realloc(table->data, size *= 2);
+			if (bigger == NULL)
+				break;
+			table->data = bigger;
+		}
+		n = read(fd, table->data + table->len, size - table->len - 1);
+		if (n <= 0) {
+			close(fd);
+			if (n < 0)
+				break;
+			table->data[table->len] = '\0';
+			return 0;
+		}
+		table->len += n;
+	}
+	close(fd);
+	port_table_free(table);
+	return -1;
+}
+
+int ipv4_tcp_table_load(struct port_table *table)
+{
+	return port_table_load(table, tcp_path);
+}
+
+int ipv4_udp_table_load(struct port_table *table)
+{
+	return port_table_load(table, udp_path);
+}
+
+void port_table_free(struct port_table *table)
+{
+	free(table->data);
+	table->data = NULL;
+	table->len = 0;
+}
+
+// find the UID associated with a local ipv4 port in a previously loaded table
+uid_t ipv4_table_port_uid(const struct port_table *table, const char *ipv4, unsigned int port)
+{
+	const char *line = table->data;
+	uint32_t want = ipv4_procaddr(ipv4), addr;
+	unsigned int found;
+	uid_t uid;
+
+	while (port_table_entry(&line, &addr, &found, &uid)) {
+	    if (addr == want && found == port) {
+		debugLog(LOG_DEBUG, "Found UID=%lu in snapshot\n", (unsigned long)uid);
+		return uid;
 	    }
 	}
-	fclose(portlist);
-	debugLog(LOG_NOTICE, "UID for TCP port %i Not found\n", port);
 	return UID_NOT_FOUND;
 }
 
-	
\ No newline at end of file
+// start of the next blank separated field before end, NULL if there is none
+static const char *next_field(const char *p, const char *end)
+{
+	while (p < end && *p != ' ' && *p != '\t')
+	    p++;
+	while (p < end && (*p == ' ' || *p == '\t'))
+	    p++;
+	return p < end ? p : NULL;
+}
+
+// parse one line "SL: ADDR:PORT REMOTE ST TX:RX TR:WHEN RETRNSMT UID ...";
+// strtoul() alone would skip the newline into the next line, so every
+// field is checked to start before end first
+static int parse_entry(const char *p, const char *end, uint32_t *addr,
+		       unsigned int *port, unsigned long *id)
+{
+	char *q;
+	int i;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+	    p++;
+	if ((p = next_field(p, end)) == NULL || !isxdigit((unsigned char)*p))
+	    return 0;
+	*addr = strtoul(p, &q, 16);
+	if (q - p > 8 || q >= end || *q != ':' || !isxdigit((unsigned char)q[1]))
+	    return 0;
+	*port = strtoul(q + 1, &q, 16);
+	for (i = 0, p = q; i < 6 && p; i++)
+	    p = next_field(p, end);
+	if (p == NULL || !isdigit((unsigned char)*p))
+	    return 0;
+	*id = strtoul(p, &q, 10);
+	return q <= end;
+}
+
+// parse the next socket of a loaded table and advance *line past it,
+// returns 0 when the end of the table is reached; looks at one line at a
+// time, sscanf() on the rest of the table would strlen() all of it
+int port_table_entry(const char **line, uint32_t *addr, unsigned int *port, uid_t *uid)
+{
+	while (*line && **line) {
+	    const char *here = *line, *end;
+	    unsigned long id;
+	    if ((end = strchr(here, '\n')) == NULL)
+		end = here + strlen(here);
+	    *line = *end ? end + 1 : end;
+	    if (parse_entry(here, end, addr, port, &id)) {
+		*uid = (uid_t)id;
+		return 1;
+	    }
+	}
+	return 0;
+}
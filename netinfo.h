@@ -17,8 +17,35 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <pwd.h>
+#include <stddef.h>
+#include <stdint.h>
 #define UID_SYSTEM	  0	/* returned for ports that are owned by a system user */
 #define UID_NOT_FOUND ((uid_t)-1)   /* returned if port is not found */
+#define BINDSTRING_LEN 32
+
+#define IPV4_TCP_PORTS  "/proc/net/tcp"
+#define IPV4_UDP_PORTS  "/proc/net/udp"
+#define IPV6_TCP_PORTS  "/proc/net/tcp6"
+#define IPV6_UDP_PORTS  "/proc/net/udp6"
+
+int ipv4_tables_live(void);
+
+/* all functions are reentrant, buffers are supplied by the caller */
+char *ipv4_bindstring(const char *ipv4, unsigned int port, char *buffer);
 
 uid_t ipv4_tcp_port_uid(const char *ipv4, unsigned int port);
 uid_t ipv4_udp_port_uid(const char *ipv4, unsigned int port);
+
+/* raw copy of a /proc/net socket table, taken at one point in time */
+struct port_table {
+	char *data;
+	size_t len;
+};
+
+int port_table_load(struct port_table *table, const char *path);
+int ipv4_tcp_table_load(struct port_table *table);
+int ipv4_udp_table_load(struct port_table *table);
+void port_table_free(struct port_table *table);
+uid_t ipv4_table_port_uid(const struct port_table *table, const char *ipv4, unsigned int port);
+uint32_t ipv4_procaddr(const char *ipv4);
+int port_table_entry(const char **line, uint32_t *addr, unsigned int *port, uid_t *uid);
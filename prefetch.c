@@ -0,0 +1,140 @@
+/*
+ * prefetch.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <syslog.h>
+
+#include "netinfo.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "debug.h"
+
+static void *prefetch_tables(void *arg)
+{
+	struct prefetch *pf = arg;
+
+	ipv4_tcp_table_load(&pf->tcp);
+	ipv4_udp_table_load(&pf->udp);
+	clock_gettime(CLOCK_MONOTONIC, &pf->finished);
+	return NULL;
+}
+
+// start reading the socket tables in the background
+void prefetch_start(struct prefetch *pf)
+{
+	sigset_t all, old;
+	int rc;
+
+	memset(pf, 0, sizeof(*pf));
+	clock_gettime(CLOCK_MONOTONIC, &pf->started);
+
+	/* signals must keep interrupting the server loop, not the helper */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&pf->thread, NULL, prefetch_tables, pf);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc != 0) {
+		debugLog(LOG_WARNING, "prefetch: cannot start helper thread\n");
+		return;
+	}
+	pf->active = 1;
+	stats_inc(STAT_PREFETCH_STARTED);
+}
+
+// use tables the caller has read; a NULL table is looked up in /proc as usual
+void prefetch_attach(struct prefetch *pf, const struct port_table *tcp,
+		     const struct port_table *udp)
+{
+	memset(pf, 0, sizeof(*pf));
+	if (tcp)
+		pf->tcp = *tcp;
+	if (udp)
+		pf->udp = *udp;
+	pf->active = 1;
+	pf->joined = 1;
+	pf->attached = 1;
+}
+
+// true if a port missing from the table for proto needs no fresh scan
+int prefetch_complete(const struct prefetch *pf, int proto)
+{
+	if (!pf->attached)
+		return 0;
+	return (proto == IPPROTO_TCP ? pf->tcp.data : pf->udp.data) != NULL;
+}
+
+// wait for the helper thread, account for the time it saved us
+static void prefetch_join(struct prefetch *pf)
+{
+	struct timespec now;
+	long hidden, waited;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_join(pf->thread, NULL);
+	pf->joined = 1;
+
+	waited = stats_elapsed_us(&now, &pf->finished);
+	if (waited < 0)
+		waited = 0;
+	hidden = stats_elapsed_us(&pf->started, &pf->finished) - waited;
+	stats_add(STAT_PREFETCH_HIDDEN_US, hidden > 0 ? hidden : 0);
+	stats_add(STAT_PREFETCH_WAIT_US, waited);
+}
+
+// look up a port in the snapshot; UID_NOT_FOUND means a fresh scan is needed
+uid_t prefetch_port_uid(struct prefetch *pf, int proto, const char *ipv4, unsigned int port)
+{
+	struct port_table *table;
+	uid_t uid = UID_NOT_FOUND;
+
+	if (!pf->active)
+		return UID_NOT_FOUND;
+	if (!pf->joined)
+		prefetch_join(pf);
+	table = (proto == IPPROTO_TCP) ? &pf->tcp : &pf->udp;
+	if (table->data)
+		uid = ipv4_table_port_uid(table, ipv4, port);
+
+	pf->consumed = 1;
+	if (pf->attached)
+		return uid;
+	if (uid != UID_NOT_FOUND)
+		stats_inc(STAT_PREFETCH_USED);
+	else
+		stats_inc(STAT_PREFETCH_MISSED);
+	return uid;
+}
+
+// release the snapshot at the end of a connection
+void prefetch_discard(struct prefetch *pf)
+{
+	if (!pf->active)
+		return;
+	pf->active = 0;
+	if (pf->attached)
+		return;
+	if (!pf->joined)
+		pthread_join(pf->thread, NULL);
+	if (!pf->consumed)
+		stats_inc(STAT_PREFETCH_UNUSED);
+	port_table_free(&pf->tcp);
+	port_table_free(&pf->udp);
+}
@@ -0,0 +1,46 @@
+/*
+ * prefetch.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Speculative socket table snapshot.  The tables are read on a helper
+ * thread as soon as a connection is accepted, so the read overlaps with
+ * sending the banner and waiting for the command.  The io_uring loop
+ * attaches tables it read after the command arrived instead; those are
+ * borrowed and complete, a port that is missing does not exist.
+ */
+struct prefetch {
+	int active;
+	int joined;
+	int consumed;
+	int attached;
+	pthread_t thread;
+	struct port_table tcp;
+	struct port_table udp;
+	struct timespec started;
+	struct timespec finished;
+};
+
+void prefetch_start(struct prefetch *pf);
+void prefetch_attach(struct prefetch *pf, const struct port_table *tcp,
+		     const struct port_table *udp);
+int prefetch_complete(const struct prefetch *pf, int proto);
+uid_t prefetch_port_uid(struct prefetch *pf, int proto, const char *ipv4, unsigned int port);
+void prefetch_discard(struct prefetch *pf);
@@ -0,0 +1,175 @@
+/*
+ * ratelimit.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+
+#include "ratelimit.h"
+#include "stats.h"
+
+struct bucket {
+	uint8_t addr[16];	/* IPv6, IPv4 clients as v4-mapped address */
+	int used;
+	double tokens;
+	struct timespec last;	/* also picks the way to evict */
+};
+
+static struct bucket buckets[RATELIMIT_SETS][RATELIMIT_WAYS];
+static uint32_t seed;
+static int seeded = 0;
+static pthread_mutex_t buckets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int client_key(const struct sockaddr *addr, uint8_t key[16])
+{
+	memset(key, 0, 16);
+	if (addr->sa_family == AF_INET6) {
+		memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+		return 1;
+	}
+	if (addr->sa_family == AF_INET) {
+		key[10] = key[11] = 0xff;
+		memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+		return 1;
+	}
+	return 0;
+}
+
+// a seed nobody outside knows, so addresses that share a set cannot be
+// worked out in advance; called with buckets_lock held
+static void seed_hash(void)
+{
+	struct timespec now;
+
+	if (seeded)
+		return;
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		seed = now.tv_nsec ^ (uint32_t)now.tv_sec << 16 ^ (uint32_t)getpid();
+	}
+	seeded = 1;
+}
+
+static uint32_t client_hash(const uint8_t key[16])
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		h = (h ^ (seed >> (8 * i) & 0xff)) * 16777619u;
+	for (i = 0; i < 16; i++)
+		h = (h ^ key[i]) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+// the bucket of this client; a new client takes the free or least
+// recently used way of its set, starting with a full bucket
+static struct bucket *client_bucket(const uint8_t key[16], double burst)
+{
+	struct bucket *set = buckets[client_hash(key) & (RATELIMIT_SETS - 1)];
+	struct bucket *victim = &set[0];
+	int i;
+
+	for (i = 0; i < RATELIMIT_WAYS; i++) {
+		if (set[i].used && memcmp(set[i].addr, key, 16) == 0)
+			return &set[i];
+		if (!set[i].used)
+			victim = &set[i];
+		else if (victim->used
+			 && (set[i].last.tv_sec < victim->last.tv_sec
+			     || (set[i].last.tv_sec == victim->last.tv_sec
+				 && set[i].last.tv_nsec < victim->last.tv_nsec)))
+			victim = &set[i];
+	}
+	memcpy(victim->addr, key, 16);
+	victim->used = 1;
+	victim->tokens = burst;
+	return victim;
+}
+
+// take a token for this client, returns 0 if the connection should be dropped;
+// a rate of 0 disables admission control, burst defaults to the rate
+int ratelimit_admit(double rate, double burst, const struct sockaddr *addr)
+{
+	uint8_t key[16];
+	struct bucket *b;
+	struct timespec now;
+	double elapsed;
+	int admit;
+
+	if (rate <= 0 || !client_key(addr, key))
+		return 1;
+	if (burst < 1)
+		burst = rate > 1 ? rate : 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&buckets_lock);
+	seed_hash();
+	b = client_bucket(key, burst);
+	elapsed = (now.tv_sec - b->last.tv_sec) + (now.tv_nsec - b->last.tv_nsec) / 1e9;
+	b->tokens += elapsed * rate;
+	if (b->tokens > burst)
+		b->tokens = burst;
+	b->last = now;
+	admit = b->tokens >= 1;
+	if (admit)
+		b->tokens -= 1;
+	pthread_mutex_unlock(&buckets_lock);
+
+	if (!admit)
+		stats_inc(STAT_THROTTLED);
+	return admit;
+}
+
+// hand the buckets to the next process on an upgrade, see negcache_save();
+// the seed goes along, it decides the set of every bucket
+int ratelimit_save(FILE *file)
+{
+	uint32_t sets = RATELIMIT_SETS, ways = RATELIMIT_WAYS;
+	size_t n;
+
+	pthread_mutex_lock(&buckets_lock);
+	seed_hash();
+	n = fwrite(&sets, sizeof(sets), 1, file) + fwrite(&ways, sizeof(ways), 1, file)
+		+ fwrite(&seed, sizeof(seed), 1, file)
+		+ fwrite(buckets, sizeof(buckets), 1, file);
+	pthread_mutex_unlock(&buckets_lock);
+	return n == 4 ? 0 : -1;
+}
+
+int ratelimit_load(FILE *file)
+{
+	static struct bucket saved[RATELIMIT_SETS][RATELIMIT_WAYS];
+	uint32_t sets, ways, saved_seed;
+
+	if (fread(&sets, sizeof(sets), 1, file) != 1 || sets != RATELIMIT_SETS
+	    || fread(&ways, sizeof(ways), 1, file) != 1 || ways != RATELIMIT_WAYS
+	    || fread(&saved_seed, sizeof(saved_seed), 1, file) != 1
+	    || fread(saved, sizeof(saved), 1, file) != 1)
+		return -1;
+	pthread_mutex_lock(&buckets_lock);
+	memcpy(buckets, saved, sizeof(buckets));
+	seed = saved_seed;
+	seeded = 1;
+	pthread_mutex_unlock(&buckets_lock);
+	return 0;
+}
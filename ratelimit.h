@@ -0,0 +1,35 @@
+/*
+ * ratelimit.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <sys/socket.h>
+
+/*
+ * Per-client token buckets, checked right after accept().  A client gets
+ * `rate' connections per second with bursts of up to `burst'.  Clients are
+ * hashed with a random seed into sets of a few buckets that hold the
+ * client address; a client that is not in its set takes the least
+ * recently used bucket with a full burst.  Other clients can only push a
+ * client out, which gives it a fresh bucket, never throttle it.
+ */
+#define RATELIMIT_SETS 128	/* power of two */
+#define RATELIMIT_WAYS 4
+
+int ratelimit_admit(double rate, double burst, const struct sockaddr *addr);
+int ratelimit_save(FILE *file);
+int ratelimit_load(FILE *file);
@@ -0,0 +1,314 @@
+/*
+ * replay.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * fritzident-replay - run a recorded trace through the daemon's code.
+ *
+ * Reads the ring written with --trace and the data captured next to it
+ * (<trace>.tcp, <trace>.udp, <trace>.passwd, <trace>.users), points the
+ * socket table and user lookups at the captured files and hands every
+ * recorded query to answerCommand() again, at the original pace or as fast
+ * as possible (-f).  Settings other than the uid ranges and the domain come
+ * from -c or the built-in defaults; sock_diag sees the live sockets, so the
+ * netlink strategy is not used.  Prints the replayed times next to the
+ * recorded ones and counts answers that differ from the recorded result,
+ * which is expected for queries made long before or after the capture.
+ * -l lists the records instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "fritzident.h"
+#include "netinfo.h"
+#include "config.h"
+#include "prefetch.h"
+#include "reply.h"
+#include "trace.h"
+#include "server.h"
+#include "capture.h"
+
+static const char *command_names[] = { "-", "USERS", "TCP", "UDP" };
+static const char *result_names[] = { "-", "USER", "SYSTEM_USER", "NOT_FOUND",
+				      "UNSPECIFIED", "LIST" };
+static const char *source_names[] = { "proc", "negcache", "snapshot", "prefetch",
+				      "netlink", "index" };
+
+static int compare_seq(const void *a, const void *b)
+{
+	const struct trace_record *x = a, *y = b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return x < y ? -1 : x > y;
+}
+
+// copy the complete records out of the ring, oldest first
+static struct trace_record *load_trace(const char *path, size_t *count)
+{
+	const struct trace_header *h;
+	const struct trace_record *ring;
+	struct trace_record *records;
+	struct stat st;
+	size_t i, n = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return NULL;
+	}
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED || (size_t)st.st_size < sizeof(*h)
+	    || h->magic != TRACE_MAGIC || h->version != TRACE_VERSION
+	    || h->record_size != sizeof(struct trace_record)
+	    || (size_t)st.st_size < sizeof(*h) + (size_t)h->slots * sizeof(*ring)) {
+		fprintf(stderr, "%s: not a fritzident trace\n", path);
+		return NULL;
+	}
+	ring = (const struct trace_record *)(h + 1);
+	if ((records = malloc(h->slots * sizeof(*records))) == NULL)
+		return NULL;
+	for (i = 0; i < h->slots; i++) {
+		records[n] = ring[i];
+		/* slots being written while we copy are skipped */
+		if (records[n].seq != 0 && records[n].seq == __atomic_load_n(&ring[i].seq, __ATOMIC_ACQUIRE))
+			n++;
+	}
+	qsort(records, n, sizeof(*records), compare_seq);
+	*count = n;
+	return records;
+}
+
+// point the lookups at the captured tables and users, returns the config
+static struct config *load_capture(const char *trace, const char *config_path)
+{
+	static char tcp[4096], udp[4096], passwd[4096];
+	char path[4096], line[512], domain[256];
+	unsigned long min, max;
+	struct config base, *cfg;
+	FILE *file;
+
+	snprintf(tcp, sizeof(tcp), "%s.tcp", trace);
+	snprintf(udp, sizeof(udp), "%s.udp", trace);
+	snprintf(passwd, sizeof(passwd), "%s.passwd", trace);
+	if (access(tcp, R_OK) < 0 || access(udp, R_OK) < 0 || access(passwd, R_OK) < 0) {
+		fprintf(stderr, "%s: no captured tables and users (SIGUSR1): %s\n",
+			trace, strerror(errno));
+		return NULL;
+	}
+	ipv4_set_table_paths(tcp, udp);
+	fi_set_passwd_file(passwd);
+
+	config_defaults(&base);
+	base.nranges = 0;
+	snprintf(path, sizeof(path), "%s.users", trace);
+	if ((file = fopen(path, "r")) == NULL) {
+		perror(path);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "range %lu-%lu", &min, &max) == 2 && base.nranges < CONFIG_MAX_RANGES) {
+			base.ranges[base.nranges].min = min;
+			base.ranges[base.nranges].max = max;
+			base.nranges++;
+		}
+		else if (sscanf(line, "domain %255[^\n]", domain) == 1)
+			base.domain = strdup(domain);
+	}
+	fclose(file);
+
+	if ((cfg = config_load(config_path, &base)) == NULL)
+		return NULL;
+	/* the shared snapshot belongs to the running daemons */
+	cfg->backend = BACKEND_PROC;
+	return cfg;
+}
+
+// the answer the daemon gives with the captured data, through its own code
+static int replay(const struct config *cfg, const struct trace_record *rec)
+{
+	char ipv4[INET_ADDRSTRLEN], cmd[BUFFER];
+	struct prefetch pf;
+	struct request req;
+	struct reply out;
+
+	switch (rec->command) {
+	case TRACE_USERS:
+		snprintf(cmd, sizeof(cmd), "USERS\r\n");
+		break;
+	case TRACE_TCP:
+	case TRACE_UDP:
+		inet_ntop(AF_INET, &rec->addr, ipv4, sizeof(ipv4));
+		snprintf(cmd, sizeof(cmd), "%s %s:%u\r\n", command_names[rec->command],
+			 ipv4, rec->port);
+		break;
+	default:
+		return TRACE_UNSPECIFIED;
+	}
+	memset(&pf, 0, sizeof(pf));
+	memset(&req, 0, sizeof(req));
+	/* deferred: the reply is built like for a client but never sent */
+	reply_init(&out, -1);
+	reply_defer(&out);
+	answerCommand(cfg, &pf, &req, &out, cmd);
+	reply_free(&out);
+	return req.rec.result;
+}
+
+static void list(const struct trace_record *records, size_t count)
+{
+	char ipv4[INET_ADDRSTRLEN], when[32];
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		const struct trace_record *r = &records[i];
+		time_t secs = r->time_ns / 1000000000;
+		strftime(when, sizeof(when), "%F %T", localtime(&secs));
+		inet_ntop(AF_INET, &r->addr, ipv4, sizeof(ipv4));
+		printf("%s.%06lu %-5s %15s:%-5u %-11s %-8s uid %-10ld"
+		       " banner %u wait %u lookup %u identity %u send %u us\n",
+		       when, (unsigned long)(r->time_ns % 1000000000 / 1000),
+		       r->command <= TRACE_UDP ? command_names[r->command] : "?",
+		       ipv4, r->port,
+		       r->result <= TRACE_LIST ? result_names[r->result] : "?",
+		       r->command >= TRACE_TCP && r->source <= TRACE_INDEX
+				? source_names[r->source] : "-",
+		       r->uid == (uint32_t)-1 ? -1L : (long)r->uid,
+		       r->stage_us[TRACE_BANNER], r->stage_us[TRACE_WAIT],
+		       r->stage_us[TRACE_LOOKUP], r->stage_us[TRACE_IDENTITY],
+		       r->stage_us[TRACE_SEND]);
+	}
+}
+
+static void percentiles(const char *what, long *us, size_t n)
+{
+	if (n == 0)
+		return;
+	qsort(us, n, sizeof(*us), compare_long);
+	printf("%-9s p50 %ld us, p99 %ld us, max %ld us\n", what,
+	       us[n / 2], us[n * 99 / 100], us[n - 1]);
+}
+
+static void usage(const char *cmdname)
+{
+	printf("Usage: %s [-f] [-l] [-c config] trace\n", cmdname);
+	printf("\t-c ... the daemon's configuration file (default: built-in defaults)\n");
+	printf("\t-f ... replay as fast as possible instead of at the recorded pace\n");
+	printf("\t-l ... list the recorded requests\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace_record *records;
+	struct config *cfg;
+	const char *config_path = NULL;
+	struct timespec start, before, after, now;
+	long *recorded, *replayed;
+	uint64_t first = 0;
+	size_t count, i, n = 0, differ = 0;
+	int c, fast = 0, listing = 0;
+
+	while ((c = getopt(argc, argv, "c:flh")) != -1) {
+		switch (c) {
+		case 'c': config_path = optarg; break;
+		case 'f': fast = 1; break;
+		case 'l': listing = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	setlogmask(LOG_UPTO(LOG_WARNING));
+	if ((records = load_trace(argv[optind], &count)) == NULL)
+		return 1;
+	if (listing) {
+		list(records, count);
+		return 0;
+	}
+	if ((cfg = load_capture(argv[optind], config_path)) == NULL)
+		return 1;
+	recorded = calloc(count + 1, sizeof(*recorded));
+	replayed = calloc(count + 1, sizeof(*replayed));
+	if (recorded == NULL || replayed == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	/* records are in completion order, a connection that started earlier
+	 * may have finished later: pace from the earliest start */
+	for (i = 0; i < count; i++)
+		if (i == 0 || records[i].time_ns < first)
+			first = records[i].time_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		const struct trace_record *r = &records[i];
+		int result;
+
+		if (r->command == TRACE_INVALID)
+			continue;
+		if (!fast) {
+			/* keep the recorded spacing relative to the earliest record */
+			int64_t ahead = (int64_t)(r->time_ns - first);
+			struct timespec wait;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ahead -= (now.tv_sec - start.tv_sec) * 1000000000LL
+				+ now.tv_nsec - start.tv_nsec;
+			if (ahead > 0) {
+				wait.tv_sec = ahead / 1000000000;
+				wait.tv_nsec = ahead % 1000000000;
+				nanosleep(&wait, NULL);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		result = replay(cfg, r);
+		clock_gettime(CLOCK_MONOTONIC, &after);
+		replayed[n] = (after.tv_sec - before.tv_sec) * 1000000L
+			+ (after.tv_nsec - before.tv_nsec) / 1000;
+		recorded[n] = r->stage_us[TRACE_LOOKUP] + r->stage_us[TRACE_IDENTITY];
+		n++;
+		if (result != r->result)
+			differ++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	printf("%zu requests replayed in %.3f s, %zu answers differ from the trace\n",
+	       n, (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9, differ);
+	percentiles("recorded", recorded, n);
+	percentiles("replayed", replayed, n);
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * reply.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "reply.h"
+#include "stats.h"
+#include "debug.h"
+
+void reply_init(struct reply *r, int fd)
+{
+	r->fd = fd;
+	r->failed = 0;
+	r->deferred = 0;
+	r->len = 0;
+	r->spill = NULL;
+	r->spill_len = r->spill_size = 0;
+}
+
+void reply_defer(struct reply *r)
+{
+	r->deferred = 1;
+}
+
+// what a deferred reply holds
+const char *reply_data(const struct reply *r, size_t *len)
+{
+	*len = r->spill ? r->spill_len : r->len;
+	return r->spill ? r->spill : r->buf;
+}
+
+void reply_free(struct reply *r)
+{
+	free(r->spill);
+	r->spill = NULL;
+	r->spill_len = r->spill_size = 0;
+}
+
+// a deferred reply that does not fit grows on the heap instead of going out
+static void reply_spill(struct reply *r, const char *data, size_t len)
+{
+	size_t need = (r->spill ? r->spill_len : r->len) + len;
+	size_t size = r->spill_size ? r->spill_size : 2 * REPLY_SIZE;
+	char *bigger;
+
+	if (r->spill == NULL || need > r->spill_size) {
+		while (size < need)
+			size *= 2;
+		if ((bigger = realloc(r->spill, size)) == NULL) {
+			debugLog(LOG_WARNING, "reply: out of memory\n");
+			r->failed = 1;
+			return;
+		}
+		if (r->spill == NULL) {
+			memcpy(bigger, r->buf, r->len);
+			r->spill_len = r->len;
+		}
+		r->spill = bigger;
+		r->spill_size = size;
+	}
+	memcpy(r->spill + r->spill_len, data, len);
+	r->spill_len += len;
+}
+
+/*
+ * Send all of iov, continuing after partial writes.  MSG_MORE keeps the
+ * kernel from pushing a short segment while more of the answer follows;
+ * MSG_NOSIGNAL turns a client that went away into EPIPE instead of SIGPIPE.
+ */
+static int send_all(struct reply *r, struct iovec *iov, int iovcnt, int more)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	while (iovcnt > 0) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		n = sendmsg(r->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if (n < 0 && errno == ENOTSOCK)
+			n = writev(r->fd, iov, iovcnt);	/* started on a pipe or tty */
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			debugLog(LOG_NOTICE, "send: %s\n", strerror(errno));
+			stats_inc(STAT_SEND_FAILED);
+			r->failed = 1;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+void reply_append(struct reply *r, const char *data, size_t len)
+{
+	struct iovec iov[2];
+
+	if (r->failed)
+		return;
+	if (r->spill == NULL && len <= REPLY_SIZE - r->len) {
+		memcpy(r->buf + r->len, data, len);
+		r->len += len;
+		return;
+	}
+	if (r->deferred) {
+		reply_spill(r, data, len);
+		return;
+	}
+	/* too big for what is left: send the buffer and the data together */
+	iov[0].iov_base = r->buf;
+	iov[0].iov_len = r->len;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	r->len = 0;
+	send_all(r, iov, 2, 1);
+}
+
+// one protocol line: prefix, text, CR LF and the NUL the Fritz!Box expects
+void reply_line(struct reply *r, const char *prefix, const char *text)
+{
+	reply_append(r, prefix, strlen(prefix));
+	if (text)
+		reply_append(r, text, strlen(text));
+	reply_append(r, "\r\n", 3);
+}
+
+// send what is buffered, returns -1 if any part of the reply failed
+int reply_flush(struct reply *r)
+{
+	struct iovec iov;
+
+	if (!r->failed && r->len > 0) {
+		iov.iov_base = r->buf;
+		iov.iov_len = r->len;
+		r->len = 0;
+		send_all(r, &iov, 1, 0);
+	}
+	return r->failed ? -1 : 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * reply.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+
+/*
+ * Per-connection output buffer.  Lines are collected on the stack and go
+ * out in as few sends as possible; data that does not fit is sent along
+ * with the buffered part in one sendmsg().  A failed send marks the reply
+ * as failed and drops the rest, the daemon keeps running.  A deferred
+ * reply never sends: it moves to the heap once it outgrows the buffer
+ * and the caller sends reply_data() itself (the io_uring loop).
+ */
+#define REPLY_SIZE 4096
+
+struct reply {
+	int fd;
+	int failed;
+	int deferred;
+	size_t len;
+	char *spill;	/* all of a deferred reply once it outgrew buf */
+	size_t spill_len;
+	size_t spill_size;
+	char buf[REPLY_SIZE];
+};
+
+void reply_init(struct reply *r, int fd);
+void reply_defer(struct reply *r);
+const char *reply_data(const struct reply *r, size_t *len);
+void reply_free(struct reply *r);
+void reply_append(struct reply *r, const char *data, size_t len);
+void reply_line(struct reply *r, const char *prefix, const char *text);
+int reply_flush(struct reply *r);
@@ -0,0 +1,47 @@
+/*
+ * server.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * What the serving loops in main.c and uring.c share: one request from
+ * the banner to the trace record (command.c, also used by
+ * fritzident-replay), and the daemon state they poll (main.c).
+ * Needs trace.h.
+ */
+#include <time.h>
+
+#define BUFFER 256	/* longest command read from a client */
+
+/* one connection as it goes into the trace */
+struct request {
+	struct trace_record rec;
+	struct timespec last;	/* end of the previous stage */
+	int timed;		/* the stages are timed for the trace */
+};
+
+struct config;
+struct prefetch;
+struct reply;
+
+void startRequest(struct request *req, int timed);
+void traceStage(struct request *req, enum trace_stage s);
+void answerCommand(const struct config *cfg, struct prefetch *pf, struct request *req,
+		   struct reply *out, char *cmd);
+
+void serverHousekeeping(void);
+int serverDraining(void);
@@ -0,0 +1,463 @@
+/*
+ * snapshot.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "fritzident.h"
+#include "netinfo.h"
+#include "config.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "debug.h"
+
+/* the generation mapped by this thread, so no thread unmaps it under another */
+static __thread const struct snapshot_header *mapped = NULL;
+static __thread size_t mapped_size = 0;
+static __thread dev_t mapped_dev;
+static __thread ino_t mapped_ino;
+
+/* unmaps a thread's generation when the thread exits, e.g. a retired worker */
+static pthread_key_t mapped_key;
+static pthread_once_t mapped_once = PTHREAD_ONCE_INIT;
+
+static uint64_t now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint32_t socket_hash(int proto, uint32_t addr, unsigned int port)
+{
+	uint32_t h = addr * 2654435761u;
+	h ^= (port << 8 | proto) * 2246822519u;
+	return h ^ (h >> 15);
+}
+
+static void snapshot_unmap(void)
+{
+	if (mapped) {
+		munmap((void *)mapped, mapped_size);
+		pthread_setspecific(mapped_key, NULL);
+	}
+	mapped = NULL;
+	mapped_size = 0;
+}
+
+static void snapshot_thread_exit(void *map)
+{
+	if (map == mapped)
+		snapshot_unmap();
+}
+
+static void snapshot_key_create(void)
+{
+	pthread_key_create(&mapped_key, snapshot_thread_exit);
+}
+
+// true if n elements of size each at offset lie inside the file after the header
+static int snapshot_region(uint64_t size, uint64_t offset, uint64_t n, uint64_t each)
+{
+	return offset >= sizeof(struct snapshot_header) && offset <= size
+		&& n <= (size - offset) / each;
+}
+
+// the readers follow the offsets and probe the hash without further
+// checks, so a file that is truncated or comes from another build must
+// not get past this
+static int snapshot_valid(const struct snapshot_header *h, size_t size)
+{
+	const struct snapshot_ident *idents;
+	uint32_t i;
+
+	if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION || h->size != size)
+		return 0;
+	if (h->socket_slots == 0 || (h->socket_slots & (h->socket_slots - 1)) != 0
+	    || h->socket_count >= h->socket_slots
+	    || !snapshot_region(size, h->socket_offset, h->socket_slots, sizeof(struct snapshot_socket))
+	    || !snapshot_region(size, h->ident_offset, h->ident_count, sizeof(struct snapshot_ident))
+	    || !snapshot_region(size, h->users_offset, h->users_len, 1))
+		return 0;
+	idents = (const void *)((const char *)h + h->ident_offset);
+	for (i = 0; i < h->ident_count; i++)
+		if (!snapshot_region(size, idents[i].name_offset, 1, 1)
+		    || memchr((const char *)h + idents[i].name_offset, '\0',
+			      size - idents[i].name_offset) == NULL)
+			return 0;
+	return 1;
+}
+
+// map the file currently found at path, if it changed
+static void snapshot_map(const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (stat(path, &st) < 0) {
+		snapshot_unmap();
+		return;
+	}
+	if (mapped && st.st_dev == mapped_dev && st.st_ino == mapped_ino)
+		return;
+
+	snapshot_unmap();
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct snapshot_header)) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	pthread_once(&mapped_once, snapshot_key_create);
+	pthread_setspecific(mapped_key, map);
+	mapped = map;
+	mapped_size = st.st_size;
+	mapped_dev = st.st_dev;
+	mapped_ino = st.st_ino;
+	if (!snapshot_valid(mapped, mapped_size)) {
+		debugLog(LOG_WARNING, "snapshot: ignoring invalid %s\n", path);
+		snapshot_unmap();
+	}
+}
+
+static int snapshot_fresh(const struct config *cfg)
+{
+	return mapped && mapped->config_hash == fi_context_hash(cfg->ctx)
+		&& now_ms() - mapped->created_ms < (uint64_t)cfg->snapshot_ttl;
+}
+
+struct ident_entry {
+	uid_t uid;
+	size_t name;
+	size_t seq;
+};
+
+static int compare_ident(const void *a, const void *b)
+{
+	const struct ident_entry *x = a, *y = b;
+	if (x->uid != y->uid)
+		return x->uid < y->uid ? -1 : 1;
+	return x->seq < y->seq ? -1 : 1;
+}
+
+// append to a growing buffer, returns the offset of the data or -1
+static long buffer_append(char **buf, size_t *len, size_t *size, const void *data, size_t n)
+{
+	long offset = *len;
+	if (*len + n > *size) {
+		size_t bigger = *size ? *size : 4096;
+		char *p;
+		while (*len + n > bigger)
+			bigger *= 2;
+		if ((p = realloc(*buf, bigger)) == NULL)
+			return -1;
+		*buf = p;
+		*size = bigger;
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+	return offset;
+}
+
+/* identities and the USERS response collected from passwd */
+struct ident_builder {
+	struct ident_entry *idents;
+	size_t nidents, maxidents;
+	char *names, *users;
+	size_t names_len, names_size, users_len, users_size;
+	int failed;
+};
+
+static int add_ident(const struct fi_user *user, void *arg)
+{
+	struct ident_builder *b = arg;
+	const char *name = user->name;
+	long offset;
+
+	if (b->nidents == b->maxidents) {
+		struct ident_entry *p;
+		b->maxidents = b->maxidents ? 2 * b->maxidents : 64;
+		if ((p = realloc(b->idents, b->maxidents * sizeof(*p))) == NULL)
+			return b->failed = 1;
+		b->idents = p;
+	}
+	offset = buffer_append(&b->names, &b->names_len, &b->names_size, name, strlen(name) + 1);
+	if (offset < 0
+	    || buffer_append(&b->users, &b->users_len, &b->users_size, name, strlen(name)) < 0
+	    || buffer_append(&b->users, &b->users_len, &b->users_size, "\r\n", 3) < 0)
+		return b->failed = 1;
+	b->idents[b->nidents].uid = user->uid;
+	b->idents[b->nidents].name = offset;
+	b->idents[b->nidents].seq = b->nidents;
+	b->nidents++;
+	return 0;
+}
+
+static void add_sockets(struct snapshot_socket *slots, uint32_t nslots,
+			const struct port_table *table, int proto, uint32_t *count)
+{
+	const char *line = table->data;
+	uint32_t addr;
+	unsigned int port;
+	uid_t uid;
+
+	while (port_table_entry(&line, &addr, &port, &uid)) {
+		uint32_t i = socket_hash(proto, addr, port) & (nslots - 1);
+		while (slots[i].used) {
+			/* like a scan of /proc, the first socket wins */
+			if (slots[i].addr == addr && slots[i].port == port && slots[i].proto == proto)
+				break;
+			i = (i + 1) & (nslots - 1);
+		}
+		if (slots[i].used)
+			continue;
+		slots[i].addr = addr;
+		slots[i].port = port;
+		slots[i].proto = proto;
+		slots[i].used = 1;
+		slots[i].uid = uid;
+		(*count)++;
+	}
+}
+
+static uint32_t count_lines(const struct port_table *table)
+{
+	const char *p;
+	uint32_t n = 0;
+	for (p = table->data; p && (p = strchr(p, '\n')); p++)
+		n++;
+	return n;
+}
+
+// build a new generation and rename it into place
+static void snapshot_build(const struct config *cfg)
+{
+	const char *path = cfg->snapshot_file;
+	struct port_table tcp, udp;
+	struct snapshot_header header;
+	struct snapshot_socket *slots = NULL;
+	struct ident_builder b;
+	struct snapshot_ident *ident_table = NULL;
+	char *file = NULL;
+	size_t file_len = 0, file_size = 0, i, j;
+	uint32_t lines;
+	char *tmp = NULL;
+	int fd = -1;
+
+	memset(&header, 0, sizeof(header));
+	memset(&b, 0, sizeof(b));
+	ipv4_tcp_table_load(&tcp);
+	ipv4_udp_table_load(&udp);
+
+	lines = count_lines(&tcp) + count_lines(&udp);
+	header.socket_slots = 64;
+	while (header.socket_slots < 2 * lines)
+		header.socket_slots *= 2;
+	slots = calloc(header.socket_slots, sizeof(*slots));
+	if (slots == NULL)
+		goto out;
+	add_sockets(slots, header.socket_slots, &tcp, IPPROTO_TCP, &header.socket_count);
+	add_sockets(slots, header.socket_slots, &udp, IPPROTO_UDP, &header.socket_count);
+
+	/* users in passwd order, exactly as execUSERS() sends them */
+	if (fi_users(cfg->ctx, add_ident, &b) < 0 || b.failed)
+		goto out;
+
+	/* getpwuid() returns the first entry for a uid, keep only that one */
+	qsort(b.idents, b.nidents, sizeof(*b.idents), compare_ident);
+	ident_table = calloc(b.nidents + 1, sizeof(*ident_table));
+	if (ident_table == NULL)
+		goto out;
+	for (i = 0, j = 0; i < b.nidents; i++) {
+		if (j > 0 && ident_table[j - 1].uid == b.idents[i].uid)
+			continue;
+		ident_table[j].uid = b.idents[i].uid;
+		ident_table[j].name_offset = b.idents[i].name;
+		j++;
+	}
+	header.ident_count = j;
+
+	/* lay out the file: header, socket hash, identities, names, USERS */
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.generation = mapped ? mapped->generation + 1 : 1;
+	header.created_ms = now_ms();
+	header.config_hash = fi_context_hash(cfg->ctx);
+	header.socket_offset = sizeof(header);
+	header.ident_offset = header.socket_offset + header.socket_slots * sizeof(*slots);
+	header.users_offset = header.ident_offset + header.ident_count * sizeof(*ident_table) + b.names_len;
+	header.users_len = b.users_len;
+	header.size = header.users_offset + b.users_len;
+	for (i = 0; i < header.ident_count; i++)
+		ident_table[i].name_offset += header.ident_offset + header.ident_count * sizeof(*ident_table);
+
+	if (buffer_append(&file, &file_len, &file_size, &header, sizeof(header)) < 0
+	    || buffer_append(&file, &file_len, &file_size, slots, header.socket_slots * sizeof(*slots)) < 0
+	    || buffer_append(&file, &file_len, &file_size, ident_table, header.ident_count * sizeof(*ident_table)) < 0
+	    || buffer_append(&file, &file_len, &file_size, b.names, b.names_len) < 0
+	    || buffer_append(&file, &file_len, &file_size, b.users, b.users_len) < 0)
+		goto out;
+
+	if ((tmp = malloc(strlen(path) + 8)) == NULL)
+		goto out;
+	sprintf(tmp, "%s.XXXXXX", path);
+	if ((fd = mkostemp(tmp, O_CLOEXEC)) < 0) {
+		debugLog(LOG_WARNING, "snapshot: %s: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	fchmod(fd, 0644);
+	if (write(fd, file, file_len) != (ssize_t)file_len || rename(tmp, path) < 0) {
+		debugLog(LOG_WARNING, "snapshot: cannot write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	stats_inc(STAT_SNAPSHOT_BUILDS);
+	debugLog(LOG_DEBUG, "snapshot: generation %llu, %u sockets, %u users\n",
+		 (unsigned long long)header.generation, header.socket_count, header.ident_count);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(tmp);
+	free(file);
+	free(b.users);
+	free(b.names);
+	free(ident_table);
+	free(b.idents);
+	free(slots);
+	port_table_free(&tcp);
+	port_table_free(&udp);
+}
+
+// make sure a fresh generation is mapped, building one if needed
+static const struct snapshot_header *snapshot_current(const struct config *cfg)
+{
+	const char *path = cfg->snapshot_file;
+	char *lockname;
+	int lockfd;
+
+	if (cfg->backend != BACKEND_SNAPSHOT)
+		return NULL;
+	snapshot_map(path);
+	if (snapshot_fresh(cfg))
+		return mapped;
+
+	/* only one instance builds, the others scan /proc themselves meanwhile */
+	if ((lockname = malloc(strlen(path) + 6)) == NULL)
+		return NULL;
+	sprintf(lockname, "%s.lock", path);
+	lockfd = open(lockname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lockfd < 0 && errno == ENOENT) {
+		/* first use after boot, /run is empty */
+		char *slash = strrchr(lockname, '/');
+		if (slash && slash != lockname) {
+			*slash = '\0';
+			mkdir(lockname, 0755);
+			*slash = '/';
+		}
+		lockfd = open(lockname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	}
+	free(lockname);
+	if (lockfd < 0)
+		return NULL;
+	if (flock(lockfd, LOCK_EX | LOCK_NB) == 0) {
+		snapshot_map(path);
+		if (!snapshot_fresh(cfg)) {
+			snapshot_build(cfg);
+			snapshot_map(path);
+		}
+	}
+	close(lockfd);
+	return snapshot_fresh(cfg) ? mapped : NULL;
+}
+
+uid_t snapshot_port_uid(const struct config *cfg, int proto, const char *ipv4, unsigned int port)
+{
+	const struct snapshot_header *snap = snapshot_current(cfg);
+	const struct snapshot_socket *slots;
+	uint32_t addr, i, n;
+
+	if (snap == NULL)
+		return UID_NOT_FOUND;
+	slots = (const void *)((const char *)snap + snap->socket_offset);
+	addr = ipv4_procaddr(ipv4);
+	i = socket_hash(proto, addr, port) & (snap->socket_slots - 1);
+	/* the table is never full, the bound is for a corrupt one */
+	for (n = 0; n < snap->socket_slots && slots[i].used; n++) {
+		if (slots[i].addr == addr && slots[i].port == port && slots[i].proto == proto) {
+			stats_inc(STAT_SNAPSHOT_HITS);
+			return slots[i].uid;
+		}
+		i = (i + 1) & (snap->socket_slots - 1);
+	}
+	stats_inc(STAT_SNAPSHOT_MISSES);
+	return UID_NOT_FOUND;
+}
+
+// name of an included user as sent to the Fritz!Box, NULL if not known
+const char *snapshot_identity(const struct config *cfg, uid_t uid)
+{
+	const struct snapshot_header *snap = snapshot_current(cfg);
+	const struct snapshot_ident *idents;
+	uint32_t lo = 0, hi;
+
+	if (snap == NULL)
+		return NULL;
+	idents = (const void *)((const char *)snap + snap->ident_offset);
+	hi = snap->ident_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (idents[mid].uid == uid)
+			return (const char *)snap + idents[mid].name_offset;
+		if (idents[mid].uid < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+// the complete USERS response, NULL if no snapshot is available
+const char *snapshot_users(const struct config *cfg, size_t *len)
+{
+	const struct snapshot_header *snap = snapshot_current(cfg);
+
+	if (snap == NULL)
+		return NULL;
+	*len = snap->users_len;
+	return (const char *)snap + snap->users_offset;
+}
@@ -0,0 +1,67 @@
+/*
+ * snapshot.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Shared snapshot of the socket tables and the user identities.  The file
+ * (usually below /run) is built by whichever fritzident instance first
+ * finds it missing or stale, written to a temporary file and renamed into
+ * place.  All instances map it read-only.  Used when the config selects
+ * BACKEND_SNAPSHOT.
+ */
+#define SNAPSHOT_PATH     "/run/fritzident/snapshot"
+#define SNAPSHOT_TTL      1000	/* ms before the snapshot is rebuilt */
+#define SNAPSHOT_MAGIC    0x44495246	/* "FRID" */
+#define SNAPSHOT_VERSION  1
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t generation;
+	uint64_t created_ms;	/* CLOCK_MONOTONIC, shared by all processes */
+	uint32_t config_hash;	/* uid ranges and domain it was built with */
+	uint32_t socket_slots;	/* size of the hash, power of two */
+	uint32_t socket_count;
+	uint32_t ident_count;
+	uint64_t socket_offset;	/* struct snapshot_socket[socket_slots] */
+	uint64_t ident_offset;	/* struct snapshot_ident[ident_count], sorted */
+	uint64_t users_offset;	/* pre-rendered USERS response */
+	uint64_t users_len;
+	uint64_t size;
+};
+
+struct snapshot_socket {
+	uint32_t addr;		/* byte order as in /proc/net */
+	uint16_t port;
+	uint8_t proto;
+	uint8_t used;		/* 0 marks an empty slot */
+	uint32_t uid;
+};
+
+struct snapshot_ident {
+	uint32_t uid;
+	uint32_t name_offset;	/* NUL terminated, domain already added */
+};
+
+struct config;
+
+uid_t snapshot_port_uid(const struct config *cfg, int proto, const char *ipv4, unsigned int port);
+const char *snapshot_identity(const struct config *cfg, uid_t uid);
+const char *snapshot_users(const struct config *cfg, size_t *len);
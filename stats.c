@@ -0,0 +1,78 @@
+/*
+ * stats.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>
+
+#include "stats.h"
+#include "debug.h"
+
+static unsigned long counters[STAT_MAX];
+
+static const char *counter_names[STAT_MAX] = {
+	[STAT_CONNECTIONS]        = "connections",
+	[STAT_PREFETCH_STARTED]   = "prefetch_started",
+	[STAT_PREFETCH_USED]      = "prefetch_used",
+	[STAT_PREFETCH_MISSED]    = "prefetch_missed",
+	[STAT_PREFETCH_UNUSED]    = "prefetch_unused",
+	[STAT_PREFETCH_HIDDEN_US] = "prefetch_hidden_us",
+	[STAT_PREFETCH_WAIT_US]   = "prefetch_wait_us",
+	[STAT_SNAPSHOT_HITS]      = "snapshot_hits",
+	[STAT_SNAPSHOT_MISSES]    = "snapshot_misses",
+	[STAT_SNAPSHOT_BUILDS]    = "snapshot_builds",
+	[STAT_NEGCACHE_HITS]      = "negcache_hits",
+	[STAT_THROTTLED]          = "throttled",
+	[STAT_SEND_FAILED]        = "send_failed",
+	[STAT_URING_ENTERS]       = "uring_enters",
+	[STAT_URING_TABLE_READS]  = "uring_table_reads",
+	[STAT_LOOKUP_PROC]        = "lookup_proc",
+	[STAT_LOOKUP_NETLINK]     = "lookup_netlink",
+	[STAT_LOOKUP_INDEX]       = "lookup_index",
+	[STAT_INDEX_BUILDS]       = "index_builds",
+	[STAT_LOOKUP_SWITCHES]    = "lookup_switches",
+};
+
+// counters are updated from helper threads, so always go through atomics
+void stats_add(enum stat_counter counter, unsigned long n)
+{
+	__atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_inc(enum stat_counter counter)
+{
+	stats_add(counter, 1);
+}
+
+unsigned long stats_get(enum stat_counter counter)
+{
+	return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+// write all counters to syslog, triggered by SIGUSR1
+void stats_log(void)
+{
+	int i;
+	for (i = 0; i < STAT_MAX; i++)
+		debugLog(LOG_NOTICE, "stats: %s=%lu\n", counter_names[i], stats_get(i));
+}
+
+long stats_elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000L
+		+ (to->tv_nsec - from->tv_nsec) / 1000L;
+}
@@ -0,0 +1,50 @@
+/*
+ * stats.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <time.h>
+
+enum stat_counter {
+	STAT_CONNECTIONS,
+	STAT_PREFETCH_STARTED,	/* snapshots started on accept() */
+	STAT_PREFETCH_USED,	/* lookups answered from the snapshot */
+	STAT_PREFETCH_MISSED,	/* lookups that fell back to a fresh scan */
+	STAT_PREFETCH_UNUSED,	/* snapshots thrown away (USERS, errors) */
+	STAT_PREFETCH_HIDDEN_US,	/* table read time overlapped with the handshake */
+	STAT_PREFETCH_WAIT_US,	/* time still spent waiting for the snapshot */
+	STAT_SNAPSHOT_HITS,	/* lookups answered from the shared snapshot */
+	STAT_SNAPSHOT_MISSES,
+	STAT_SNAPSHOT_BUILDS,	/* generations built by this process */
+	STAT_NEGCACHE_HITS,	/* NOT_FOUND answered without a scan */
+	STAT_THROTTLED,	/* connections dropped by admission control */
+	STAT_SEND_FAILED,	/* replies cut short by a send error */
+	STAT_URING_ENTERS,	/* io_uring_enter() calls of the io_uring loop */
+	STAT_URING_TABLE_READS,	/* socket table reads shared by a batch of queries */
+	STAT_LOOKUP_PROC,	/* lookups per backend, see strategy.h */
+	STAT_LOOKUP_NETLINK,
+	STAT_LOOKUP_INDEX,
+	STAT_INDEX_BUILDS,	/* index reads, each shared by a burst */
+	STAT_LOOKUP_SWITCHES,	/* changes of the adaptive choice */
+	STAT_MAX
+};
+
+void stats_add(enum stat_counter counter, unsigned long n);
+void stats_inc(enum stat_counter counter);
+unsigned long stats_get(enum stat_counter counter);
+void stats_log(void);
+
+long stats_elapsed_us(const struct timespec *from, const struct timespec *to);
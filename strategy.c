@@ -0,0 +1,527 @@
+/*
+ * strategy.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#include "fritzident.h"
+#include "netinfo.h"
+#include "config.h"
+#include "strategy.h"
+#include "stats.h"
+#include "debug.h"
+
+#define COST_WEIGHT  0.25	/* weight of the newest window in the averages */
+#define INDEX_WINDOW 8		/* index queries before their cost counts */
+
+enum reason { REASON_UNMEASURED, REASON_CONFIGURED, REASON_CHEAPEST,
+	      REASON_MARGIN, REASON_HOLD, REASON_FAILED };
+
+static const char *strategy_names[] = { "auto", "proc", "netlink", "index" };
+
+static const char *reason_names[] = {
+	[REASON_UNMEASURED] = "rivals not measured yet",
+	[REASON_CONFIGURED] = "set in the config",
+	[REASON_CHEAPEST]   = "cheapest",
+	[REASON_MARGIN]     = "rivals cheaper by less than the margin",
+	[REASON_HOLD]       = "held after a switch",
+	[REASON_FAILED]     = "netlink failed",
+};
+
+struct cost {
+	double us;		/* CPU time per query, 0 until measured */
+	long sockets;		/* table size it was measured at */
+	uint64_t measured;	/* ms, CLOCK_MONOTONIC */
+	double window_us;	/* sums since the last decision */
+	unsigned long window_queries;
+};
+
+struct index_slot {
+	uint32_t addr;		/* byte order as in /proc/net */
+	uint16_t port;
+	uint8_t used;		/* 0 marks an empty slot */
+	uid_t uid;
+};
+
+struct port_index {
+	struct index_slot *slots;
+	uint32_t nslots;	/* power of two */
+	uint64_t started;	/* ns, CLOCK_MONOTONIC, when the table read began */
+};
+
+struct proto_state {
+	int proto;
+	const char *name;
+	int (*load)(struct port_table *table);
+	enum lookup_strategy current;
+	enum lookup_strategy probe;	/* the next query times this one, 0 if none */
+	enum reason reason;
+	uint64_t since;		/* ms, when current was chosen */
+	uint64_t window;	/* ms, start of the decision window, 0 before the first query */
+	unsigned long queries;	/* in this window */
+	double rate;		/* queries per second */
+	long sockets;
+	int netlink_failed;
+	struct cost cost[LOOKUP_INDEX + 1];
+	double build_us;	/* CPU time of an index build */
+	long build_sockets;
+	double index_ratio;	/* measured index cost against the model */
+	struct port_index index;
+	int building;
+};
+
+/* guards all of states[]; the lookups themselves run without it */
+static pthread_mutex_t strategy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t index_built = PTHREAD_COND_INITIALIZER;
+static struct proto_state states[2] = {
+	{ .proto = IPPROTO_TCP, .name = "tcp", .load = ipv4_tcp_table_load,
+	  .current = LOOKUP_PROC, .index_ratio = 1 },
+	{ .proto = IPPROTO_UDP, .name = "udp", .load = ipv4_udp_table_load,
+	  .current = LOOKUP_PROC, .index_ratio = 1 },
+};
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t index_hash(uint32_t addr, unsigned int port)
+{
+	uint32_t h = addr * 2654435761u;
+	h ^= port * 2246822519u;
+	return h ^ (h >> 15);
+}
+
+static uid_t index_find(const struct port_index *index, uint32_t addr, unsigned int port)
+{
+	uint32_t i = index_hash(addr, port) & (index->nslots - 1);
+
+	while (index->slots[i].used) {
+		if (index->slots[i].addr == addr && index->slots[i].port == port)
+			return index->slots[i].uid;
+		i = (i + 1) & (index->nslots - 1);
+	}
+	return UID_NOT_FOUND;
+}
+
+// read a whole table into a new index, returns 0 on success
+static int index_build(int (*load)(struct port_table *), struct port_index *index)
+{
+	struct port_table table;
+	const char *line;
+	uint32_t addr, lines = 0;
+	unsigned int port;
+	uid_t uid;
+
+	index->started = now_ns(CLOCK_MONOTONIC);
+	if (load(&table) < 0)
+		return -1;
+	for (line = table.data; (line = strchr(line, '\n')); line++)
+		lines++;
+	for (index->nslots = 16; index->nslots < 2 * lines; index->nslots *= 2)
+		;
+	if ((index->slots = calloc(index->nslots, sizeof(*index->slots))) == NULL) {
+		port_table_free(&table);
+		return -1;
+	}
+	line = table.data;
+	while (port_table_entry(&line, &addr, &port, &uid)) {
+		uint32_t i = index_hash(addr, port) & (index->nslots - 1);
+		/* like a scan of /proc, the first socket wins */
+		while (index->slots[i].used
+		       && !(index->slots[i].addr == addr && index->slots[i].port == port))
+			i = (i + 1) & (index->nslots - 1);
+		if (index->slots[i].used)
+			continue;
+		index->slots[i].addr = addr;
+		index->slots[i].port = port;
+		index->slots[i].used = 1;
+		index->slots[i].uid = uid;
+	}
+	port_table_free(&table);
+	stats_inc(STAT_INDEX_BUILDS);
+	return 0;
+}
+
+/*
+ * Found ports are answered from an index read at most INDEX_MAX_AGE ms
+ * before the query; a miss only counts in an index read after the query
+ * came in.  Queries that arrive while the table is read wait for that
+ * read instead of starting their own, which is what makes bursts cheap.
+ */
+static uid_t index_port_uid(struct proto_state *ps, uint32_t addr, unsigned int port,
+			    uint64_t asked, int *failed)
+{
+	struct port_index fresh, stale;
+	uint64_t cpu;
+	uid_t uid;
+
+	pthread_mutex_lock(&strategy_lock);
+	for (;;) {
+		if (ps->index.slots && asked < ps->index.started + INDEX_MAX_AGE * 1000000ull) {
+			uid = index_find(&ps->index, addr, port);
+			if (uid != UID_NOT_FOUND || ps->index.started >= asked) {
+				pthread_mutex_unlock(&strategy_lock);
+				return uid;
+			}
+		}
+		if (!ps->building)
+			break;
+		pthread_cond_wait(&index_built, &strategy_lock);
+	}
+	ps->building = 1;
+	pthread_mutex_unlock(&strategy_lock);
+
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	if (index_build(ps->load, &fresh) < 0) {
+		pthread_mutex_lock(&strategy_lock);
+		ps->building = 0;
+		pthread_cond_broadcast(&index_built);
+		pthread_mutex_unlock(&strategy_lock);
+		*failed = 1;
+		return UID_NOT_FOUND;
+	}
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	uid = index_find(&fresh, addr, port);
+
+	pthread_mutex_lock(&strategy_lock);
+	stale = ps->index;
+	ps->index = fresh;
+	ps->building = 0;
+	ps->build_us = ps->build_us ? (1 - COST_WEIGHT) * ps->build_us + COST_WEIGHT * cpu / 1000.0
+		: cpu / 1000.0;
+	ps->build_sockets = ps->sockets;
+	ps->cost[LOOKUP_INDEX].measured = fresh.started / 1000000;
+	pthread_cond_broadcast(&index_built);
+	pthread_mutex_unlock(&strategy_lock);
+	free(stale.slots);
+	return uid;
+}
+
+// ask sock_diag for the sockets bound to port, the kernel does the filtering
+static uid_t netlink_port_uid(int proto, uint32_t addr, unsigned int port, int *failed)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+		struct nlattr bytecode;
+		struct inet_diag_bc_op ops[4];
+	} request;
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+	long buffer[8192 / sizeof(long)];
+	uid_t uid = UID_NOT_FOUND;
+	int fd, done = 0;
+
+	if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG)) < 0) {
+		*failed = 1;
+		return UID_NOT_FOUND;
+	}
+	memset(&request, 0, sizeof(request));
+	request.nlh.nlmsg_len = sizeof(request);
+	request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.req.sdiag_family = AF_INET;
+	request.req.sdiag_protocol = proto;
+	request.req.idiag_states = ~0u;
+	request.bytecode.nla_len = sizeof(request.bytecode) + sizeof(request.ops);
+	request.bytecode.nla_type = INET_DIAG_REQ_BYTECODE;
+	/* sport >= port && sport <= port; a jump past the end rejects */
+	request.ops[0].code = INET_DIAG_BC_S_GE;
+	request.ops[0].yes = 2 * sizeof(request.ops[0]);
+	request.ops[0].no = 5 * sizeof(request.ops[0]);
+	request.ops[1].no = port;
+	request.ops[2].code = INET_DIAG_BC_S_LE;
+	request.ops[2].yes = 2 * sizeof(request.ops[0]);
+	request.ops[2].no = 3 * sizeof(request.ops[0]);
+	request.ops[3].no = port;
+
+	if (sendto(fd, &request, sizeof(request), 0,
+		   (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+		done = *failed = 1;
+	while (!done) {
+		struct nlmsghdr *h;
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			*failed = 1;
+			break;
+		}
+		for (h = (struct nlmsghdr *)buffer; !done && NLMSG_OK(h, n); h = NLMSG_NEXT(h, n)) {
+			const struct inet_diag_msg *msg = NLMSG_DATA(h);
+
+			if (h->nlmsg_type == NLMSG_DONE)
+				done = 1;
+			else if (h->nlmsg_type == NLMSG_ERROR) {
+				errno = -((const struct nlmsgerr *)NLMSG_DATA(h))->error;
+				done = *failed = 1;
+			}
+			/* same order as /proc, so the first match is the same socket */
+			else if (msg->id.idiag_src[0] == addr && ntohs(msg->id.idiag_sport) == port) {
+				uid = msg->idiag_uid;
+				done = 1;
+			}
+		}
+	}
+	close(fd);
+	return uid;
+}
+
+// sockets in a table as the kernel counts them, -1 if unknown
+static long table_sockets(int proto)
+{
+	char line[256];
+	long inuse, tw, n = -1;
+	FILE *file = fopen("/proc/net/sockstat", "re");
+
+	if (file == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), file)) {
+		if (proto == IPPROTO_TCP
+		    && sscanf(line, "TCP: inuse %ld orphan %*d tw %ld", &inuse, &tw) == 2)
+			n = inuse + tw;
+		else if (proto == IPPROTO_UDP && sscanf(line, "UDP: inuse %ld", &inuse) == 1)
+			n = inuse;
+	}
+	fclose(file);
+	return n;
+}
+
+// a cost measured at one table size, carried over to another
+static double scaled(double us, long then, long now)
+{
+	if (then < 0 || now < 0)
+		return us;
+	return us * (now + 64) / (then + 64);
+}
+
+// index cost per query if every read is shared by the queries of INDEX_MAX_AGE ms
+static double index_model(const struct proto_state *ps)
+{
+	return scaled(ps->build_us, ps->build_sockets, ps->sockets)
+		/ (1 + ps->rate * INDEX_MAX_AGE / 1000);
+}
+
+// expected CPU time per query in us, 0 if not known
+static double estimate(const struct proto_state *ps, enum lookup_strategy s)
+{
+	const struct cost *c = &ps->cost[s];
+
+	if (s == LOOKUP_NETLINK && ps->netlink_failed)
+		return 0;
+	if (s == LOOKUP_INDEX)
+		return index_model(ps) * ps->index_ratio;
+	return scaled(c->us, c->sockets, ps->sockets);
+}
+
+static void strategy_switch(struct proto_state *ps, enum lookup_strategy to,
+			    enum reason reason, uint64_t now)
+{
+	debugLog(LOG_INFO, "lookup: %s now uses %s (%s), %.0f us/query against %.0f for %s,"
+		 " %ld sockets, %.1f queries/s\n", ps->name, strategy_names[to],
+		 reason_names[reason], estimate(ps, to), estimate(ps, ps->current),
+		 strategy_names[ps->current], ps->sockets, ps->rate);
+	ps->current = to;
+	ps->since = now;
+	stats_inc(STAT_LOOKUP_SWITCHES);
+}
+
+// close the window: update rate, size and costs, then keep or switch
+static void strategy_decide(struct proto_state *ps, enum lookup_strategy setting, uint64_t now)
+{
+	enum lookup_strategy s, best = 0;
+	double rate, current;
+	long sockets;
+	int unmeasured = 0;
+
+	if (ps->window == 0) {
+		/* sock_diag shows the live sockets, not the captured tables of a replay */
+		if (!ipv4_tables_live())
+			ps->netlink_failed = 1;
+		ps->window = ps->since = now;
+		if (setting != LOOKUP_AUTO)
+			ps->current = setting;
+		ps->reason = setting != LOOKUP_AUTO ? REASON_CONFIGURED : REASON_UNMEASURED;
+		return;
+	}
+	rate = ps->queries * 1000.0 / (now - ps->window);
+	ps->rate = ps->rate ? (ps->rate + rate) / 2 : rate;
+	if ((sockets = table_sockets(ps->proto)) >= 0)
+		ps->sockets = sockets;
+	for (s = LOOKUP_PROC; s <= LOOKUP_INDEX; s++) {
+		struct cost *c = &ps->cost[s];
+		double mean;
+
+		if (c->window_queries == 0)
+			continue;
+		mean = c->window_us / c->window_queries;
+		/* index probes are builds and already went into build_us; the
+		 * real cost is collected over windows until there are enough */
+		if (s == LOOKUP_INDEX && ps->current == LOOKUP_INDEX) {
+			if (c->window_queries < INDEX_WINDOW)
+				continue;
+			if (index_model(ps) > 0)
+				ps->index_ratio = (1 - COST_WEIGHT) * ps->index_ratio
+					+ COST_WEIGHT * mean / index_model(ps);
+		}
+		else if (s != LOOKUP_INDEX) {
+			c->us = c->us ? (1 - COST_WEIGHT) * c->us + COST_WEIGHT * mean : mean;
+			c->sockets = ps->sockets;
+			c->measured = now;
+		}
+		c->window_us = 0;
+		c->window_queries = 0;
+	}
+	ps->window = now;
+	ps->queries = 0;
+
+	if (setting != LOOKUP_AUTO) {
+		ps->reason = REASON_CONFIGURED;
+		if (setting == LOOKUP_NETLINK && ps->netlink_failed) {
+			setting = LOOKUP_PROC;
+			ps->reason = REASON_FAILED;
+		}
+		if (setting != ps->current)
+			strategy_switch(ps, setting, ps->reason, now);
+		ps->probe = 0;
+		return;
+	}
+
+	for (s = LOOKUP_PROC; s <= LOOKUP_INDEX; s++) {
+		double e = estimate(ps, s);
+		if (e == 0 && !(s == LOOKUP_NETLINK && ps->netlink_failed))
+			unmeasured = 1;
+		if (e > 0 && (best == 0 || e < estimate(ps, best)))
+			best = s;
+	}
+	current = estimate(ps, ps->current);
+	if (ps->current == LOOKUP_NETLINK && ps->netlink_failed) {
+		strategy_switch(ps, best && best != LOOKUP_NETLINK ? best : LOOKUP_PROC,
+				REASON_FAILED, now);
+		ps->reason = REASON_FAILED;
+	}
+	else if (best == 0 || best == ps->current)
+		ps->reason = unmeasured ? REASON_UNMEASURED : REASON_CHEAPEST;
+	else if (now - ps->since < STRATEGY_HOLD)
+		ps->reason = REASON_HOLD;
+	else if (current > 0 && estimate(ps, best) > current * (1 - STRATEGY_MARGIN))
+		ps->reason = REASON_MARGIN;
+	else {
+		strategy_switch(ps, best, REASON_CHEAPEST, now);
+		ps->reason = REASON_CHEAPEST;
+	}
+
+	/* time one query on a backend whose cost is unknown or old */
+	for (s = LOOKUP_PROC; s <= LOOKUP_INDEX && !ps->probe; s++)
+		if (s != ps->current && !(s == LOOKUP_NETLINK && ps->netlink_failed)
+		    && now - ps->cost[s].measured >= STRATEGY_PROBE)
+			ps->probe = s;
+}
+
+// owner of a local port through the backend chosen for its protocol
+uid_t strategy_port_uid(enum lookup_strategy setting, int proto, const char *ipv4,
+			unsigned int port, enum lookup_strategy *used)
+{
+	struct proto_state *ps = &states[proto == IPPROTO_UDP];
+	uint64_t asked = now_ns(CLOCK_MONOTONIC), cpu;
+	enum lookup_strategy s;
+	uid_t uid = UID_NOT_FOUND;
+	int failed = 0;
+
+	*used = LOOKUP_PROC;
+	if (proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+		return UID_NOT_FOUND;
+
+	pthread_mutex_lock(&strategy_lock);
+	if (asked / 1000000 - ps->window >= STRATEGY_INTERVAL)
+		strategy_decide(ps, setting, asked / 1000000);
+	ps->queries++;
+	s = ps->current;
+	if (setting != LOOKUP_AUTO)
+		s = setting;
+	else if (ps->probe) {
+		s = ps->probe;
+		ps->probe = 0;
+	}
+	if (s == LOOKUP_NETLINK && ps->netlink_failed)
+		s = LOOKUP_PROC;
+	pthread_mutex_unlock(&strategy_lock);
+
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	if (s == LOOKUP_NETLINK)
+		uid = netlink_port_uid(proto, ipv4_procaddr(ipv4), port, &failed);
+	else if (s == LOOKUP_INDEX)
+		uid = index_port_uid(ps, ipv4_procaddr(ipv4), port, asked, &failed);
+	if (failed) {
+		debugLog(LOG_WARNING, "lookup: %s %s failed (%s), scanning /proc\n",
+			 ps->name, strategy_names[s], strerror(errno));
+		if (s == LOOKUP_NETLINK) {
+			pthread_mutex_lock(&strategy_lock);
+			ps->netlink_failed = 1;
+			pthread_mutex_unlock(&strategy_lock);
+		}
+		s = LOOKUP_PROC;
+	}
+	if (s == LOOKUP_PROC)
+		uid = proto == IPPROTO_TCP ? ipv4_tcp_port_uid(ipv4, port)
+			: ipv4_udp_port_uid(ipv4, port);
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+
+	pthread_mutex_lock(&strategy_lock);
+	ps->cost[s].window_us += cpu / 1000.0;
+	ps->cost[s].window_queries++;
+	pthread_mutex_unlock(&strategy_lock);
+	stats_inc(s == LOOKUP_NETLINK ? STAT_LOOKUP_NETLINK
+		  : s == LOOKUP_INDEX ? STAT_LOOKUP_INDEX : STAT_LOOKUP_PROC);
+	*used = s;
+	return uid;
+}
+
+// current choice per protocol and why, next to the counters on SIGUSR1
+void strategy_log(void)
+{
+	int i;
+
+	pthread_mutex_lock(&strategy_lock);
+	for (i = 0; i < 2; i++) {
+		const struct proto_state *ps = &states[i];
+		debugLog(LOG_NOTICE, "stats: lookup_%s=%s (%s), %ld sockets, %.1f queries/s,"
+			 " us/query proc %.0f netlink %.0f index %.0f\n",
+			 ps->name, strategy_names[ps->current], reason_names[ps->reason],
+			 ps->sockets, ps->rate, estimate(ps, LOOKUP_PROC),
+			 estimate(ps, LOOKUP_NETLINK), estimate(ps, LOOKUP_INDEX));
+	}
+	pthread_mutex_unlock(&strategy_lock);
+}
@@ -0,0 +1,39 @@
+/*
+ * strategy.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/types.h>
+
+/*
+ * Adaptive socket lookup for the queries no cache could answer.  Three
+ * backends: a scan of /proc/net that stops at the first match, a sock_diag
+ * dump that the kernel filters down to the port, and a hash index of the
+ * whole table that the queries of a burst share.  Per protocol the CPU
+ * time of each backend is measured, scaled with the number of sockets and,
+ * for the index, with the query rate; the cheapest one is used.  A switch
+ * needs a rival that is STRATEGY_MARGIN cheaper and the current choice to
+ * be STRATEGY_HOLD old, so the choice does not flap.  Needs config.h.
+ */
+#define STRATEGY_INTERVAL 1000	/* ms between decisions */
+#define STRATEGY_HOLD     5000	/* ms a choice is kept at least */
+#define STRATEGY_PROBE    10000	/* ms before an unused backend is timed again */
+#define STRATEGY_MARGIN   0.25	/* how much cheaper a rival has to be */
+#define INDEX_MAX_AGE     200	/* ms an index may answer found ports */
+
+uid_t strategy_port_uid(enum lookup_strategy setting, int proto, const char *ipv4,
+			unsigned int port, enum lookup_strategy *used);
+void strategy_log(void);
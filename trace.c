@@ -0,0 +1,201 @@
+/*
+ * trace.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fritzident.h"
+#include "netinfo.h"
+#include "config.h"
+#include "trace.h"
+#include "capture.h"
+#include "debug.h"
+
+static struct trace_header *ring = NULL;
+static struct trace_record *records;
+static char *trace_path = NULL;
+
+/*
+ * Map the ring file, creating or resizing it as needed.  An existing ring
+ * of the same size is continued, so a restart or an upgrade keeps the
+ * records from before.
+ */
+int trace_open(const char *path, unsigned int slots)
+{
+	struct trace_header *h;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	if (slots == 0)
+		slots = TRACE_SLOTS;
+	size = sizeof(*h) + (size_t)slots * sizeof(struct trace_record);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640)) < 0) {
+		debugLog(LOG_ERR, "trace: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || ((size_t)st.st_size != size && ftruncate(fd, 0) < 0)
+	    || ftruncate(fd, size) < 0) {
+		debugLog(LOG_ERR, "trace: %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		debugLog(LOG_ERR, "trace: mmap: %s\n", strerror(errno));
+		return -1;
+	}
+	if (h->magic != TRACE_MAGIC || h->version != TRACE_VERSION || h->slots != slots
+	    || h->record_size != sizeof(struct trace_record)) {
+		memset(h, 0, sizeof(*h));
+		h->slots = slots;
+		h->record_size = sizeof(struct trace_record);
+		h->version = TRACE_VERSION;
+		__atomic_store_n(&h->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+	}
+	free(trace_path);
+	trace_path = strdup(path);
+	records = (struct trace_record *)(h + 1);
+	ring = h;
+	return 0;
+}
+
+int trace_enabled(void)
+{
+	return ring != NULL;
+}
+
+// claim the next slot and copy the record in; seq is stored last
+void trace_write(struct trace_record *rec)
+{
+	uint64_t n;
+	struct trace_record *slot;
+
+	if (ring == NULL)
+		return;
+	n = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	slot = &records[n % ring->slots];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)slot + sizeof(slot->seq), (char *)rec + sizeof(rec->seq),
+	       sizeof(*rec) - sizeof(rec->seq));
+	__atomic_store_n(&slot->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+static int capture_table(const char *suffix, const char *proc)
+{
+	struct port_table table;
+	char path[4096], tmp[4200];
+	FILE *file;
+	int rc;
+
+	snprintf(path, sizeof(path), "%s.%s", trace_path, suffix);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (port_table_load(&table, proc) < 0)
+		return -1;
+	if ((file = fopen(tmp, "we")) == NULL) {
+		port_table_free(&table);
+		return -1;
+	}
+	rc = fwrite(table.data, 1, table.len, file) == table.len ? 0 : -1;
+	port_table_free(&table);
+	if (fclose(file) != 0 || rc < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static int capture_passwd(const struct config *cfg)
+{
+	char path[4096], tmp[4200];
+	FILE *file;
+	int rc;
+
+	snprintf(path, sizeof(path), "%s.passwd", trace_path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((file = fopen(tmp, "we")) == NULL)
+		return -1;
+	rc = fi_write_passwd(cfg->ctx, file);
+	if (fclose(file) != 0 || rc < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static int capture_user(const struct fi_user *user, void *arg)
+{
+	fprintf(arg, "user %lu %s\n", (unsigned long)user->uid, user->name);
+	return 0;
+}
+
+/*
+ * Save the socket tables and the users next to the ring file (<trace>.tcp,
+ * <trace>.udp, <trace>.passwd, <trace>.users), so a replay sees the same
+ * sockets and answers.  The passwd file holds the entries of the included
+ * users, the users file the uid ranges, the domain and, for reading, the
+ * names as they are sent.
+ */
+int trace_capture(const struct config *cfg)
+{
+	char path[4096], tmp[4200];
+	FILE *file;
+	int i, rc;
+
+	if (ring == NULL)
+		return 0;
+	if (capture_table("tcp", "/proc/net/tcp") < 0 || capture_table("udp", "/proc/net/udp") < 0) {
+		debugLog(LOG_WARNING, "trace: cannot capture the socket tables: %s\n", strerror(errno));
+		return -1;
+	}
+	if (capture_passwd(cfg) < 0) {
+		debugLog(LOG_WARNING, "trace: cannot capture the users: %s\n", strerror(errno));
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s.users", trace_path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((file = fopen(tmp, "we")) == NULL) {
+		debugLog(LOG_WARNING, "trace: %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < cfg->nranges; i++)
+		fprintf(file, "range %lu-%lu\n", (unsigned long)cfg->ranges[i].min,
+			(unsigned long)cfg->ranges[i].max);
+	if (cfg->domain)
+		fprintf(file, "domain %s\n", cfg->domain);
+	fi_users(cfg->ctx, capture_user, file);
+	rc = ferror(file) ? -1 : 0;
+	if (fclose(file) != 0 || rc < 0 || rename(tmp, path) < 0) {
+		debugLog(LOG_WARNING, "trace: cannot write %s\n", path);
+		unlink(tmp);
+		return -1;
+	}
+	debugLog(LOG_INFO, "trace: captured socket tables and users\n");
+	return 0;
+}
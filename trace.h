@@ -0,0 +1,69 @@
+/*
+ * trace.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+/*
+ * Request trace.  Every connection leaves one fixed-size record in a ring
+ * that is memory mapped from a file, so recording costs a few stores and
+ * no system call.  The file can be read while the daemon runs or after it
+ * is gone; fritzident-replay feeds it back through the lookup code.
+ */
+#define TRACE_MAGIC   0x46495452	/* "FITR" */
+#define TRACE_VERSION 1
+#define TRACE_SLOTS   65536		/* default ring size in records */
+
+enum trace_command { TRACE_INVALID, TRACE_USERS, TRACE_TCP, TRACE_UDP };
+enum trace_result { TRACE_NONE, TRACE_USER, TRACE_SYSTEM_USER, TRACE_NOT_FOUND,
+		    TRACE_UNSPECIFIED, TRACE_LIST };
+/* where the uid of a TCP or UDP query came from */
+enum trace_source { TRACE_PROC, TRACE_NEGCACHE, TRACE_SNAPSHOT, TRACE_PREFETCH,
+		    TRACE_NETLINK, TRACE_INDEX };
+/* per-stage times in us, each measured from the end of the previous one */
+enum trace_stage { TRACE_BANNER, TRACE_WAIT, TRACE_LOOKUP, TRACE_IDENTITY,
+		   TRACE_SEND, TRACE_STAGES };
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t record_size;
+	uint64_t head;		/* records written so far, slot is head % slots */
+	uint64_t pad[5];
+};
+
+struct trace_record {
+	uint64_t seq;		/* head + 1 when written, 0 while being written */
+	uint64_t time_ns;	/* CLOCK_REALTIME at accept */
+	uint32_t addr;		/* queried address, network byte order */
+	uint32_t uid;
+	uint16_t port;
+	uint8_t command;
+	uint8_t result;
+	uint8_t source;
+	uint8_t pad[3];
+	uint32_t stage_us[TRACE_STAGES];
+};
+
+struct config;
+
+int trace_open(const char *path, unsigned int slots);
+int trace_enabled(void);
+void trace_write(struct trace_record *rec);
+int trace_capture(const struct config *cfg);
@@ -0,0 +1,284 @@
+/*
+ * upgrade.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "upgrade.h"
+#include "negcache.h"
+#include "ratelimit.h"
+#include "debug.h"
+
+#define STATE_MAGIC   0x46495355	/* "FISU" */
+#define STATE_VERSION 3
+#define FIRST_FD      3			/* SD_LISTEN_FDS_START */
+
+extern char **environ;
+
+/* the new process until it reports, see upgrade_poll() */
+static pid_t starting = -1;
+static int starting_fd = -1;
+static struct timespec starting_since;
+static pid_t failed = -1;	/* told to stop, not reaped yet */
+
+struct state_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+static int state_save(void)
+{
+	struct state_header h = { STATE_MAGIC, STATE_VERSION };
+	FILE *file;
+	int fd, rc;
+
+	if ((fd = memfd_create("fritzident-state", MFD_CLOEXEC)) < 0)
+		return -1;
+	if ((file = fdopen(dup(fd), "w")) == NULL) {
+		close(fd);
+		return -1;
+	}
+	rc = fwrite(&h, sizeof(h), 1, file) == 1 ? 0 : -1;
+	if (rc == 0)
+		rc = negcache_save(file);
+	if (rc == 0)
+		rc = ratelimit_save(file);
+	if (fclose(file) != 0)
+		rc = -1;
+	if (rc < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// "NAME=<n>" with the digits written by hand, usable between fork and exec
+static void set_number(char *var, long n)
+{
+	char digits[24];
+	int i = 0;
+
+	var = strchr(var, '=') + 1;
+	do {
+		digits[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (i)
+		*var++ = digits[--i];
+	*var = '\0';
+}
+
+// path of the running binary; after a package update the link has " (deleted)"
+static int exe_path(char *path, size_t len)
+{
+	ssize_t n = readlink("/proc/self/exe", path, len - 1);
+	char *deleted;
+
+	if (n < 0)
+		return -1;
+	path[n] = '\0';
+	if ((deleted = strstr(path, " (deleted)")) != NULL && deleted[10] == '\0')
+		*deleted = '\0';
+	return 0;
+}
+
+/*
+ * Start a new instance that inherits the listening sockets fds[0..nfds-1]
+ * and the caches.  Returns its pid without waiting for it, or -1 if it
+ * could not be started; upgrade_poll() tells when it serves.  The caller
+ * keeps serving meanwhile and serializes the calls.
+ */
+pid_t upgrade_exec(char *const argv[], const int *fds, int nfds)
+{
+	char path[4096];
+	char listen_pid[32] = "LISTEN_PID=", listen_fds[32] = "LISTEN_FDS=";
+	char state_env[48] = UPGRADE_STATE_ENV "=", ready_env[48] = UPGRADE_READY_ENV "=";
+	char **env = NULL;
+	int high[nfds + 2];	/* the fds to pass, above the range they go to */
+	int ready[2] = { -1, -1 };
+	int state, i, n = 0;
+	pid_t pid = -1;
+
+	for (i = 0; i < nfds + 2; i++)
+		high[i] = -1;
+	if (exe_path(path, sizeof(path)) < 0) {
+		debugLog(LOG_ERR, "upgrade: cannot find the binary: %s\n", strerror(errno));
+		return -1;
+	}
+	if ((state = state_save()) < 0)
+		debugLog(LOG_WARNING, "upgrade: caches not handed over: %s\n", strerror(errno));
+	if (pipe2(ready, O_CLOEXEC) < 0)
+		goto fail;
+
+	/* the environment without our variables, plus the new ones */
+	for (i = 0; environ[i]; i++)
+		;
+	if ((env = calloc(i + 5, sizeof(*env))) == NULL)
+		goto fail;
+	for (i = 0; environ[i]; i++) {
+		if (!strncmp(environ[i], "LISTEN_", 7) || !strncmp(environ[i], "FRITZIDENT_", 11))
+			continue;
+		env[n++] = environ[i];
+	}
+	set_number(listen_fds, nfds);
+	set_number(ready_env, FIRST_FD + nfds);
+	set_number(state_env, FIRST_FD + nfds + 1);
+	env[n++] = listen_pid;
+	env[n++] = listen_fds;
+	env[n++] = ready_env;
+	if (state >= 0)
+		env[n++] = state_env;
+
+	for (i = 0; i < nfds; i++)
+		high[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, FIRST_FD + nfds + 2);
+	high[nfds] = fcntl(ready[1], F_DUPFD_CLOEXEC, FIRST_FD + nfds + 2);
+	high[nfds + 1] = state >= 0 ? fcntl(state, F_DUPFD_CLOEXEC, FIRST_FD + nfds + 2) : -1;
+	for (i = 0; i < nfds + 1; i++)
+		if (high[i] < 0)
+			goto fail;
+
+	pid = fork();
+	if (pid == 0) {
+		/* only async-signal-safe calls from here on */
+		set_number(listen_pid, getpid());
+		for (i = 0; i < nfds + 2; i++)
+			if (high[i] >= 0 && dup2(high[i], FIRST_FD + i) < 0)
+				_exit(127);
+		execve(path, argv, env);
+		_exit(127);
+	}
+	if (pid < 0)
+		goto fail;
+
+	/* the new process reports on the pipe once it is serving */
+	clock_gettime(CLOCK_MONOTONIC, &starting_since);
+	starting_fd = ready[0];
+	ready[0] = -1;
+	__atomic_store_n(&starting, pid, __ATOMIC_RELEASE);
+	goto out;
+
+fail:
+	debugLog(LOG_ERR, "upgrade: %s\n", strerror(errno));
+out:
+	for (i = 0; i < nfds + 2; i++)
+		if (high[i] >= 0)
+			close(high[i]);
+	if (ready[0] >= 0)
+		close(ready[0]);
+	if (ready[1] >= 0)
+		close(ready[1]);
+	if (state >= 0)
+		close(state);
+	free(env);
+	return pid;
+}
+
+// true while a new process starts or one that failed is not reaped yet
+int upgrade_pending(void)
+{
+	return __atomic_load_n(&starting, __ATOMIC_ACQUIRE) > 0
+		|| __atomic_load_n(&failed, __ATOMIC_ACQUIRE) > 0;
+}
+
+// check on the new process without blocking: its pid once it serves, 0
+// while it starts, -1 if it exited or did not report within
+// UPGRADE_TIMEOUT, in which case it is stopped; serialized like
+// upgrade_exec()
+pid_t upgrade_poll(void)
+{
+	struct pollfd pfd = { starting_fd, POLLIN, 0 };
+	struct timespec now;
+	pid_t pid = starting;
+	char ok;
+	int n;
+
+	if (failed > 0 && waitpid(failed, NULL, WNOHANG) != 0)
+		__atomic_store_n(&failed, -1, __ATOMIC_RELEASE);
+	if (pid <= 0)
+		return 0;
+	if ((n = poll(&pfd, 1, 0)) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - starting_since.tv_sec) * 1000
+		    + (now.tv_nsec - starting_since.tv_nsec) / 1000000 < UPGRADE_TIMEOUT)
+			return 0;
+	}
+	if (n <= 0 || read(starting_fd, &ok, 1) != 1) {
+		debugLog(LOG_ERR, "upgrade: new process %d did not start, keep serving\n", (int)pid);
+		kill(pid, SIGTERM);
+		__atomic_store_n(&failed, pid, __ATOMIC_RELEASE);
+		pid = -1;
+	}
+	close(starting_fd);
+	starting_fd = -1;
+	__atomic_store_n(&starting, -1, __ATOMIC_RELEASE);
+	return pid;
+}
+
+// in the new process: take over the caches of the old one
+void upgrade_resume(void)
+{
+	struct state_header h;
+	const char *env = getenv(UPGRADE_STATE_ENV);
+	FILE *file;
+	int fd;
+
+	if (env == NULL)
+		return;
+	fd = atoi(env);
+	unsetenv(UPGRADE_STATE_ENV);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if ((file = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return;
+	}
+	if (fread(&h, sizeof(h), 1, file) != 1 || h.magic != STATE_MAGIC
+	    || h.version != STATE_VERSION
+	    || negcache_load(file) < 0 || ratelimit_load(file) < 0)
+		debugLog(LOG_WARNING, "upgrade: handed over caches not usable, starting cold\n");
+	else
+		debugLog(LOG_INFO, "upgrade: caches taken over\n");
+	fclose(file);
+}
+
+// in the new process: tell the old one that we accept connections now
+void upgrade_ready(void)
+{
+	const char *env = getenv(UPGRADE_READY_ENV);
+	int fd;
+
+	if (env == NULL)
+		return;
+	fd = atoi(env);
+	unsetenv(UPGRADE_READY_ENV);
+	if (write(fd, "1", 1) != 1)
+		debugLog(LOG_WARNING, "upgrade: cannot report readiness\n");
+	close(fd);
+}
@@ -0,0 +1,36 @@
+/*
+ * upgrade.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+
+/*
+ * Graceful re-exec.  The running daemon starts the binary again with its
+ * listening sockets as LISTEN_FDS and the process-local caches in a memfd
+ * and keeps serving; once upgrade_poll() reports the new process serving,
+ * it stops accepting and drains.
+ */
+#define UPGRADE_STATE_ENV "FRITZIDENT_STATE_FD"
+#define UPGRADE_READY_ENV "FRITZIDENT_READY_FD"
+#define UPGRADE_TIMEOUT   5000	/* ms the new process gets to start serving */
+
+pid_t upgrade_exec(char *const argv[], const int *fds, int nfds);
+int upgrade_pending(void);
+pid_t upgrade_poll(void);
+void upgrade_resume(void);
+void upgrade_ready(void);
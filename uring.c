@@ -0,0 +1,969 @@
+/*
+ * uring.c
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The ring is driven with the raw system calls, there is no liburing
+ * dependency.  Every submission carries its kind and the connection or
+ * listener it belongs to in user_data.  A connection goes through
+ *
+ *   send banner -> read command (fixed buffer) [-> link timeout]
+ *   -> wait for the socket tables (TCP and UDP queries only)
+ *   -> answer on a helper thread
+ *   -> send answer [-> link timeout] -> close
+ *
+ * and is taken apart once all its submissions have completed.  Queries
+ * that are waiting when a table read is submitted share it: like
+ * proc_port_uid(), which stops at the first match, a query is answered
+ * as soon as its socket shows up, and the read stops once nobody waits
+ * for the rest.  Only a table read to the end makes a port NOT_FOUND.
+ * The ring thread never blocks: user lookups through NSS, USERS lists,
+ * snapshot rebuilds and scans of their own run on the helpers, which get
+ * a copy of the table line they need and hand the connection back through
+ * an eventfd the ring reads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "uring.h"
+#include "debug.h"
+
+#ifndef NO_IO_URING
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "netinfo.h"
+#include "config.h"
+#include "prefetch.h"
+#include "negcache.h"
+#include "ratelimit.h"
+#include "reply.h"
+#include "trace.h"
+#include "server.h"
+#include "stats.h"
+
+enum uring_event {
+	EV_ACCEPT,
+	EV_BANNER,
+	EV_COMMAND,
+	EV_TIMEOUT,
+	EV_ANSWER,
+	EV_CLOSE,
+	EV_TABLE,
+	EV_TICK,
+	EV_CANCEL,
+	EV_DONE
+};
+
+#define EVENT(kind, index) ((uint64_t)(kind) << 32 | (uint32_t)(index))
+
+enum conn_state {
+	CONN_FREE,
+	CONN_COMMAND,	/* banner and command read in flight */
+	CONN_QUEUED,	/* waiting for the socket tables */
+	CONN_ANSWERING,	/* with a helper thread */
+	CONN_CLOSING	/* answer and close in flight */
+};
+
+struct conn {
+	int fd;
+	enum conn_state state;
+	int pending;	/* submissions that have not completed yet */
+	int failed;
+	int len;	/* command bytes received */
+	int table;	/* the table the query waits for */
+	char ipv4[16];	/* and the socket it asks about */
+	unsigned int port;
+	char line[256];	/* its line of the table, for the helper */
+	size_t sent;
+	struct __kernel_timespec timeout;
+	struct request req;
+	struct prefetch pf;
+	struct reply out;
+};
+
+struct listener {
+	int fd;
+	int armed;
+	int canceling;
+};
+
+/* a socket table, re-read from its open file starting at offset 0; a
+ * read returns about a page, the next one goes out when it completes */
+struct table {
+	int fd;
+	int waiting;	/* queries of the batch not answered yet */
+	char *buf;	/* registered buffer 1 + table */
+	size_t size;
+	size_t pos;	/* bytes read so far */
+	int complete;	/* read up to the end */
+};
+
+static const char banner[] = "AVM IDENT\r\n";	/* sizeof() includes the NUL */
+
+static struct {
+	int fd;
+	unsigned entries;
+	unsigned tail;	/* ours, published on submit */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size, sqes_size;
+} ring = { .fd = -1 };
+
+static struct conn conns[URING_CONNS];
+static char commands[URING_CONNS][BUFFER];	/* registered buffer 0 */
+static int free_conns[URING_CONNS];
+static int nfree;
+
+static struct listener *listens;
+static int nlistens;
+static int multishot = 1;
+static int stopping = 0;
+
+static struct table tables[2];	/* TCP, UDP; also the fixed file indexes */
+/* connections in CONN_QUEUED, oldest first; the first nbatch of them wait
+ * for the reads in flight, and those answered early are set to -1 so a
+ * reused slot is not seen twice.  That leaves room for a whole batch plus
+ * one of every connection queued behind it. */
+static int queued[2 * URING_CONNS];
+static int nqueued;
+static int nbatch;
+static int reading;	/* table reads in flight */
+
+static struct __kernel_timespec tick = { 1, 0 };
+static int tick_armed;
+
+/* the helper threads: connections to answer in arrival order, and the
+ * answered ones the ring has not picked up yet */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int todo[URING_CONNS];
+	int first, ntodo;
+	int done[URING_CONNS];
+	int ndone;
+	int quit;
+	int fd;		/* eventfd, counts answers */
+	uint64_t count;	/* read from it by the ring */
+	pthread_t threads[CONFIG_MAX_THREADS];
+	int nthreads;
+} helpers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, .fd = -1 };
+
+static int ring_register(unsigned op, void *arg, unsigned nr)
+{
+	return (int)syscall(__NR_io_uring_register, ring.fd, op, arg, nr);
+}
+
+// submit what is queued and wait for at least wait completions, returns -errno
+static int ring_submit(unsigned wait)
+{
+	unsigned submit;
+	int rc;
+
+	__atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+	submit = ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	if (submit == 0 && wait == 0)
+		return 0;
+	stats_inc(STAT_URING_ENTERS);
+	rc = (int)syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+			  IORING_ENTER_GETEVENTS, NULL, 0);
+	return rc < 0 ? -errno : rc;
+}
+
+// make room for n submissions that have to go in with the same call
+static void ring_reserve(unsigned n)
+{
+	int rc;
+
+	while (ring.tail + n - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > ring.entries) {
+		rc = ring_submit(0);
+		if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY) {
+			debugLog(LOG_ERR, "io_uring_enter: %s\n", strerror(-rc));
+			exit(-rc);
+		}
+	}
+}
+
+static struct io_uring_sqe *ring_prep(int op, int fd, const void *addr, unsigned len,
+				      uint64_t off, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	ring_reserve(1);
+	sqe = &ring.sqes[ring.tail++ & *ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = data;
+	return sqe;
+}
+
+static int ring_map(const struct io_uring_params *p)
+{
+	char *sq, *cq;
+	unsigned i;
+
+	ring.sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring.cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_size > ring.sq_size)
+			ring.sq_size = ring.cq_size;
+		ring.cq_size = 0;
+	}
+	sq = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	ring.sq_ring = sq;
+	cq = sq;
+	if (ring.cq_size) {
+		cq = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -1;
+		ring.cq_ring = cq;
+	}
+	ring.sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		ring.sqes = NULL;
+		return -1;
+	}
+
+	ring.entries = p->sq_entries;
+	ring.sq_head = (unsigned *)(sq + p->sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p->sq_off.array);
+	ring.cq_head = (unsigned *)(cq + p->cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	ring.tail = *ring.sq_tail;
+	for (i = 0; i < ring.entries; i++)
+		ring.sq_array[i] = i;
+	return 0;
+}
+
+// returns 0 if the kernel knows every operation the loop uses
+static int ring_probe(void)
+{
+	static const int ops[] = {
+		IORING_OP_ACCEPT, IORING_OP_SEND, IORING_OP_READ_FIXED, IORING_OP_READ, IORING_OP_CLOSE,
+		IORING_OP_LINK_TIMEOUT, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL
+	};
+	struct io_uring_probe *probe;
+	size_t i;
+	int rc = 0;
+
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (probe == NULL || ring_register(IORING_REGISTER_PROBE, probe, 256) < 0) {
+		free(probe);
+		return -1;
+	}
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			rc = -1;
+	free(probe);
+	return rc;
+}
+
+static void ring_close(void)
+{
+	int i;
+
+	if (ring.fd >= 0)
+		close(ring.fd);
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_ring)
+		munmap(ring.cq_ring, ring.cq_size);
+	if (ring.sq_ring)
+		munmap(ring.sq_ring, ring.sq_size);
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+	for (i = 0; i < 2; i++) {
+		if (tables[i].fd >= 0)
+			close(tables[i].fd);
+		free(tables[i].buf);
+		memset(&tables[i], 0, sizeof(tables[i]));
+		tables[i].fd = -1;
+	}
+	free(listens);
+	listens = NULL;
+	if (helpers.fd >= 0)
+		close(helpers.fd);
+	helpers.fd = -1;
+}
+
+/*
+ * Set up the ring, the registered buffers and files.  Returns -1 if the
+ * kernel lacks io_uring or one of the features the loop needs.
+ */
+int uring_open(const int *fds, int nfds)
+{
+	static const char *paths[2] = { IPV4_TCP_PORTS, IPV4_UDP_PORTS };
+	struct io_uring_params p;
+	struct iovec iov[3];
+	int files[2];
+	int i;
+
+	/* ring_close() must not take stdin, the client in inetd mode */
+	for (i = 0; i < 2; i++)
+		tables[i].fd = -1;
+	memset(&p, 0, sizeof(p));
+	/* both flags only save work, kernels before 5.19 reject them */
+	p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	ring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		ring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	}
+	if (ring.fd < 0) {
+		debugLog(LOG_WARNING, "io_uring: %s, using the poll loop\n", strerror(errno));
+		ring.fd = -1;
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_NODROP) || ring_map(&p) < 0 || ring_probe() < 0) {
+		debugLog(LOG_WARNING, "io_uring: kernel too old, using the poll loop\n");
+		ring_close();
+		return -1;
+	}
+
+	iov[0].iov_base = commands;
+	iov[0].iov_len = sizeof(commands);
+	for (i = 0; i < 2; i++) {
+		tables[i].fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+		tables[i].size = URING_TABLE;
+		tables[i].buf = malloc(tables[i].size);
+		if (tables[i].buf == NULL) {
+			debugLog(LOG_WARNING, "io_uring: out of memory, using the poll loop\n");
+			ring_close();
+			return -1;
+		}
+		files[i] = tables[i].fd;
+		iov[1 + i].iov_base = tables[i].buf;
+		iov[1 + i].iov_len = tables[i].size;
+	}
+	if (ring_register(IORING_REGISTER_BUFFERS, iov, 3) < 0
+	    || ring_register(IORING_REGISTER_FILES, files, 2) < 0) {
+		debugLog(LOG_WARNING, "io_uring: cannot register buffers: %s, using the poll loop\n",
+			 strerror(errno));
+		ring_close();
+		return -1;
+	}
+
+	if ((helpers.fd = eventfd(0, EFD_CLOEXEC)) < 0
+	    || (listens = calloc(nfds, sizeof(*listens))) == NULL) {
+		ring_close();
+		return -1;
+	}
+	for (i = 0; i < nfds; i++)
+		listens[i].fd = fds[i];
+	nlistens = nfds;
+	for (nfree = 0; nfree < URING_CONNS; nfree++)
+		free_conns[nfree] = URING_CONNS - 1 - nfree;
+	debugLog(LOG_INFO, "Serving through io_uring\n");
+	return 0;
+}
+
+static void listener_arm(int i)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ring_prep(IORING_OP_ACCEPT, listens[i].fd, NULL, 0, 0, EVENT(EV_ACCEPT, i));
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if (multishot)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	listens[i].armed = 1;
+}
+
+// keep accepting while there is room, leave the backlog alone otherwise
+static void uring_listeners(void)
+{
+	struct io_uring_sqe *sqe;
+	int want = !stopping && nfree > URING_CONNS / 4;
+	int i;
+
+	for (i = 0; i < nlistens; i++) {
+		if (want && !listens[i].armed)
+			listener_arm(i);
+		else if (!want && listens[i].armed && !listens[i].canceling) {
+			sqe = ring_prep(IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, EVENT(EV_CANCEL, i));
+			sqe->addr = EVENT(EV_ACCEPT, i);
+			listens[i].canceling = 1;
+		}
+	}
+}
+
+static void conn_close(struct conn *c)
+{
+	ring_prep(IORING_OP_CLOSE, c->fd, NULL, 0, 0, EVENT(EV_CLOSE, c - conns));
+	c->pending = 1;
+	c->state = CONN_CLOSING;
+}
+
+static void conn_free(struct conn *c)
+{
+	trace_write(&c->req.rec);
+	reply_free(&c->out);
+	c->state = CONN_FREE;
+	free_conns[nfree++] = c - conns;
+}
+
+static void uring_accept(const struct config *cfg, int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	struct io_uring_sqe *sqe;
+	struct conn *c;
+	int i;
+
+	/* throttled peers are dropped before any lookup work */
+	if (cfg->client_rate > 0
+	    && (getpeername(fd, (struct sockaddr *)&addr, &addrlen) < 0
+		|| !ratelimit_admit(cfg->client_rate, cfg->client_burst, (struct sockaddr *)&addr))) {
+		close(fd);
+		return;
+	}
+	/* only a multishot accept that was already under way gets here */
+	if (nfree == 0) {
+		stats_inc(STAT_THROTTLED);
+		close(fd);
+		return;
+	}
+	i = free_conns[--nfree];
+	c = &conns[i];
+	c->fd = fd;
+	c->state = CONN_COMMAND;
+	c->failed = 0;
+	c->len = 0;
+	startRequest(&c->req, trace_enabled());
+	memset(&c->pf, 0, sizeof(c->pf));
+	reply_init(&c->out, fd);
+	reply_defer(&c->out);
+
+	/* the Fritz!Box sends the command after the banner */
+	ring_reserve(3);
+	sqe = ring_prep(IORING_OP_SEND, fd, banner, sizeof(banner), 0, EVENT(EV_BANNER, i));
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe = ring_prep(IORING_OP_READ_FIXED, fd, commands[i], BUFFER - 1, 0, EVENT(EV_COMMAND, i));
+	sqe->buf_index = 0;
+	c->pending = 2;
+	if (cfg->timeout > 0) {
+		sqe->flags = IOSQE_IO_LINK;
+		c->timeout.tv_sec = cfg->timeout / 1000;
+		c->timeout.tv_nsec = (cfg->timeout % 1000) * 1000000;
+		ring_prep(IORING_OP_LINK_TIMEOUT, -1, &c->timeout, 1, 0, EVENT(EV_TIMEOUT, i));
+		c->pending++;
+	}
+}
+
+static void listener_event(const struct config *cfg, int i, int res, unsigned flags)
+{
+	struct listener *l = &listens[i];
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		l->armed = 0;
+		l->canceling = 0;
+	}
+	if (res >= 0) {
+		uring_accept(cfg, res);
+		return;
+	}
+	if (res == -EINVAL && multishot) {
+		debugLog(LOG_INFO, "io_uring: no multishot accept, re-arming after every connection\n");
+		multishot = 0;
+		return;
+	}
+	if (res == -ECANCELED || res == -EINTR || res == -EAGAIN || res == -ECONNABORTED)
+		return;
+	debugLog(LOG_ERR, "accept connection failed: %s\n", strerror(-res));
+	exit(-res);
+}
+
+// the table a query needs, -1 if it is answered without one
+static int table_wanted(const struct config *cfg, struct conn *c)
+{
+	char proto[4];
+	int i;
+
+	if (cfg->backend != BACKEND_PROC
+	    || sscanf(commands[c - conns], " %3s %15[0-9.]:%u", proto, c->ipv4, &c->port) != 3)
+		return -1;
+	if (!strcmp(proto, "TCP"))
+		i = 0;
+	else if (!strcmp(proto, "UDP"))
+		i = 1;
+	else
+		return -1;
+	/* a known miss would keep the read going to the end for nothing */
+	if (tables[i].fd < 0 || negcache_known(cfg->negative_ttl, i ? IPPROTO_UDP : IPPROTO_TCP,
+						c->ipv4, c->port))
+		return -1;
+	return i;
+}
+
+// answer the commands the ring hands over until uring_serve() stops
+static void *helper_loop(void *arg)
+{
+	const struct config *cfg;
+	struct conn *c;
+	uint64_t one = 1;
+	int i;
+
+	if (config_register() < 0) {
+		debugLog(LOG_ERR, "Too many serving threads\n");
+		exit(1);
+	}
+	pthread_mutex_lock(&helpers.lock);
+	for (;;) {
+		while (helpers.ntodo == 0 && !helpers.quit)
+			pthread_cond_wait(&helpers.wake, &helpers.lock);
+		if (helpers.ntodo == 0)
+			break;
+		i = helpers.todo[helpers.first];
+		helpers.first = (helpers.first + 1) % URING_CONNS;
+		helpers.ntodo--;
+		pthread_mutex_unlock(&helpers.lock);
+
+		/* deferred, so a long USERS list does not block in send() */
+		c = &conns[i];
+		cfg = config_enter();
+		answerCommand(cfg, &c->pf, &c->req, &c->out, commands[i]);
+		prefetch_discard(&c->pf);
+		config_leave();
+
+		pthread_mutex_lock(&helpers.lock);
+		helpers.done[helpers.ndone++] = i;
+		if (write(helpers.fd, &one, sizeof(one)) < 0)
+			debugLog(LOG_ERR, "eventfd: %s\n", strerror(errno));
+	}
+	pthread_mutex_unlock(&helpers.lock);
+	config_unregister();
+	return NULL;
+}
+
+// start n helper threads, at least URING_HELPERS
+static void helpers_start(int n)
+{
+	if (n < URING_HELPERS)
+		n = URING_HELPERS;
+	for (helpers.nthreads = 0; helpers.nthreads < n; helpers.nthreads++) {
+		if (pthread_create(&helpers.threads[helpers.nthreads], NULL, helper_loop, NULL) != 0) {
+			debugLog(LOG_WARNING, "Cannot start serving thread %d\n", helpers.nthreads);
+			break;
+		}
+	}
+	if (helpers.nthreads == 0)
+		exit(1);
+}
+
+static void helpers_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&helpers.lock);
+	helpers.quit = 1;
+	pthread_cond_broadcast(&helpers.wake);
+	pthread_mutex_unlock(&helpers.lock);
+	for (i = 0; i < helpers.nthreads; i++)
+		pthread_join(helpers.threads[i], NULL);
+}
+
+static void uring_answer(struct conn *c)
+{
+	c->state = CONN_ANSWERING;
+	pthread_mutex_lock(&helpers.lock);
+	helpers.todo[(helpers.first + helpers.ntodo++) % URING_CONNS] = c - conns;
+	pthread_cond_signal(&helpers.wake);
+	pthread_mutex_unlock(&helpers.lock);
+}
+
+// send the answer a helper built, then close
+static void uring_send(const struct config *cfg, struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+	const char *data;
+	int i = c - conns;
+
+	data = reply_data(&c->out, &c->sent);
+	if (c->out.failed || c->sent == 0) {
+		conn_close(c);
+		return;
+	}
+	/* the close only runs if all of the answer went out in time */
+	ring_reserve(3);
+	sqe = ring_prep(IORING_OP_SEND, c->fd, data, c->sent, 0, EVENT(EV_ANSWER, i));
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->flags = IOSQE_IO_LINK;
+	c->pending = 2;
+	if (cfg->timeout > 0) {
+		c->timeout.tv_sec = cfg->timeout / 1000;
+		c->timeout.tv_nsec = (cfg->timeout % 1000) * 1000000;
+		sqe = ring_prep(IORING_OP_LINK_TIMEOUT, -1, &c->timeout, 1, 0, EVENT(EV_TIMEOUT, i));
+		sqe->flags = IOSQE_IO_LINK;
+		c->pending++;
+	}
+	ring_prep(IORING_OP_CLOSE, c->fd, NULL, 0, 0, EVENT(EV_CLOSE, i));
+	c->state = CONN_CLOSING;
+}
+
+// pick up the answers the helpers finished, keep the eventfd read armed
+static void helpers_event(const struct config *cfg, int res)
+{
+	int done[URING_CONNS];
+	int i, n;
+
+	if (res < 0 && res != -EINTR && res != -EAGAIN && res != -ECANCELED)
+		debugLog(LOG_NOTICE, "io_uring: eventfd read: %s\n", strerror(-res));
+	pthread_mutex_lock(&helpers.lock);
+	n = helpers.ndone;
+	memcpy(done, helpers.done, n * sizeof(done[0]));
+	helpers.ndone = 0;
+	pthread_mutex_unlock(&helpers.lock);
+	for (i = 0; i < n; i++)
+		uring_send(cfg, &conns[done[i]]);
+	ring_prep(IORING_OP_READ, helpers.fd, &helpers.count, sizeof(helpers.count), 0,
+		  EVENT(EV_DONE, 0));
+}
+
+// all submissions of c are done, move it on
+static void conn_next(const struct config *cfg, struct conn *c)
+{
+	if (c->state == CONN_CLOSING) {
+		conn_free(c);
+		return;
+	}
+	if (c->failed || c->len == 0) {
+		conn_close(c);
+		return;
+	}
+	c->table = table_wanted(cfg, c);
+	if (c->table < 0 || nqueued == sizeof(queued) / sizeof(queued[0])) {
+		uring_answer(c);
+		return;
+	}
+	c->line[0] = '\0';
+	c->state = CONN_QUEUED;
+	queued[nqueued++] = c - conns;
+}
+
+static void table_read(int i)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ring_prep(IORING_OP_READ_FIXED, i, tables[i].buf + tables[i].pos,
+			tables[i].size - 1 - tables[i].pos, tables[i].pos, EVENT(EV_TABLE, i));
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->buf_index = 1 + i;
+}
+
+// read the tables the queued queries need, unless a read is under way
+static void uring_tables(void)
+{
+	int i;
+
+	if (reading || nqueued == 0)
+		return;
+	for (i = 0; i < nqueued; i++)
+		tables[conns[queued[i]].table].waiting++;
+	for (i = 0; i < 2; i++) {
+		if (!tables[i].waiting)
+			continue;
+		tables[i].pos = 0;
+		tables[i].complete = 0;
+		table_read(i);
+		reading++;
+	}
+	nbatch = nqueued;
+	stats_inc(STAT_URING_TABLE_READS);
+}
+
+// copy the line of the socket c asks about to c->line, 0 if chunk lacks it
+static int table_find(const struct port_table *chunk, struct conn *c)
+{
+	const char *line = chunk->data, *start;
+	uint32_t want = ipv4_procaddr(c->ipv4), addr;
+	unsigned int port;
+	uid_t uid;
+	size_t len;
+
+	while (port_table_entry(&line, &addr, &port, &uid)) {
+		if (addr != want || port != c->port)
+			continue;
+		/* the entry is the last line before where the parse stopped */
+		for (start = line - (line[-1] == '\n'); start > chunk->data && start[-1] != '\n'; start--)
+			;
+		len = line - start;
+		if (len >= sizeof(c->line))
+			len = 0;	/* the helper scans again */
+		memcpy(c->line, start, len);
+		c->line[len] = '\0';
+		return 1;
+	}
+	return 0;
+}
+
+/* hand c to a helper with its line of the table; the table buffers are
+ * only touched on the ring thread, the next read overwrites them */
+static void table_answer(struct conn *c)
+{
+	struct port_table data[2];
+
+	memset(data, 0, sizeof(data));
+	/* an empty line from a complete table: the port does not exist */
+	if (c->line[0] || tables[c->table].complete) {
+		data[c->table].data = c->line;
+		data[c->table].len = strlen(c->line);
+	}
+	prefetch_attach(&c->pf, &data[0], &data[1]);
+	uring_answer(c);
+}
+
+/* the table filled the buffer and may be cut off: register one twice the
+ * size in place of the old one, this batch scans /proc per query */
+static void table_grow(int i)
+{
+	struct io_uring_rsrc_update2 update;
+	struct iovec iov;
+	char *bigger;
+
+	if ((bigger = malloc(tables[i].size * 2)) == NULL)
+		return;
+	iov.iov_base = bigger;
+	iov.iov_len = tables[i].size * 2;
+	memset(&update, 0, sizeof(update));
+	update.offset = 1 + i;
+	update.data = (uintptr_t)&iov;
+	update.nr = 1;
+	if (ring_register(IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0) {
+		debugLog(LOG_WARNING, "io_uring: cannot grow the socket table buffer: %s\n",
+			 strerror(errno));
+		free(bigger);
+		close(tables[i].fd);
+		tables[i].fd = -1;
+		return;
+	}
+	free(tables[i].buf);
+	tables[i].buf = bigger;
+	tables[i].size *= 2;
+	debugLog(LOG_INFO, "io_uring: socket table buffer grown to %zu bytes\n", tables[i].size);
+}
+
+static void table_event(int i, int res)
+{
+	struct table *t = &tables[i];
+	struct port_table chunk;
+	struct conn *c;
+	int j;
+
+	if (res > 0) {
+		/* seq_file reads end on a line, the chunk can be searched alone */
+		chunk.data = t->buf + t->pos;
+		chunk.len = res;
+		t->pos += res;
+		t->buf[t->pos] = '\0';
+		for (j = 0; j < nbatch && t->waiting > 0; j++) {
+			if (queued[j] < 0)
+				continue;
+			c = &conns[queued[j]];
+			if (c->table == i && table_find(&chunk, c)) {
+				queued[j] = -1;
+				t->waiting--;
+				table_answer(c);
+			}
+		}
+		if (t->waiting > 0 && t->pos < t->size - 1) {
+			table_read(i);
+			return;
+		}
+		/* with everybody found the rest of the table is skipped */
+		if (t->waiting > 0)
+			table_grow(i);
+	}
+	else if (res == 0)
+		t->complete = 1;
+	else
+		debugLog(LOG_NOTICE, "io_uring: socket table read: %s\n", strerror(-res));
+	t->waiting = 0;
+	if (--reading > 0)
+		return;
+
+	/* the rest of the batch: NOT_FOUND if the table is complete,
+	 * otherwise a scan of their own */
+	for (j = 0; j < nbatch; j++) {
+		if (queued[j] < 0)
+			continue;
+		table_answer(&conns[queued[j]]);
+	}
+	nqueued -= nbatch;
+	memmove(queued, queued + nbatch, nqueued * sizeof(queued[0]));
+	nbatch = 0;
+	for (j = 0; j < 2; j++)
+		tables[j].complete = 0;
+}
+
+static void uring_complete(const struct config *cfg, const struct io_uring_cqe *cqe)
+{
+	unsigned kind = cqe->user_data >> 32;
+	int i = (uint32_t)cqe->user_data;
+	int res = cqe->res;
+	struct conn *c = &conns[i];
+
+	switch (kind) {
+	case EV_ACCEPT:
+		listener_event(cfg, i, res, cqe->flags);
+		return;
+	case EV_TABLE:
+		table_event(i, res);
+		return;
+	case EV_DONE:
+		helpers_event(cfg, res);
+		return;
+	case EV_TICK:
+		tick_armed = 0;
+		return;
+	case EV_CANCEL:
+		return;
+	case EV_BANNER:
+		traceStage(&c->req, TRACE_BANNER);
+		if (res != (int)sizeof(banner)) {
+			if (res < 0)
+				debugLog(LOG_NOTICE, "send: %s\n", strerror(-res));
+			stats_inc(STAT_SEND_FAILED);
+			c->failed = 1;
+		}
+		break;
+	case EV_COMMAND:
+		traceStage(&c->req, TRACE_WAIT);
+		if (res > 0) {
+			commands[i][res] = '\0';
+			c->len = res;
+		}
+		else if (res < 0 && !c->failed)
+			/* canceled by the link timeout */
+			debugLog(LOG_NOTICE, "recv: %s\n", strerror(res == -ECANCELED ? EAGAIN : -res));
+		break;
+	case EV_ANSWER:
+		traceStage(&c->req, TRACE_SEND);
+		if (res != (int)c->sent) {
+			if (res < 0)
+				debugLog(LOG_NOTICE, "send: %s\n", strerror(-res));
+			stats_inc(STAT_SEND_FAILED);
+		}
+		break;
+	case EV_CLOSE:
+		/* canceled along with an answer that did not go out */
+		if (res == -ECANCELED)
+			close(c->fd);
+		break;
+	}
+	if (--c->pending == 0)
+		conn_next(cfg, c);
+}
+
+static void uring_reap(const struct config *cfg)
+{
+	struct io_uring_cqe cqe;
+	unsigned head = *ring.cq_head;
+
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = ring.cqes[head & *ring.cq_mask];
+		__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+		uring_complete(cfg, &cqe);
+	}
+}
+
+/* the io_uring loop, returns once the daemon drained */
+void uring_serve(void)
+{
+	const struct config *cfg;
+	int rc;
+
+	if (config_register() < 0) {
+		debugLog(LOG_ERR, "Too many serving threads\n");
+		exit(1);
+	}
+	cfg = config_enter();
+	helpers_start(cfg->threads);
+	config_leave();
+	ring_prep(IORING_OP_READ, helpers.fd, &helpers.count, sizeof(helpers.count), 0,
+		  EVENT(EV_DONE, 0));
+	for (;;) {
+		/* the tick wakes the loop up for signals that hit other threads */
+		serverHousekeeping();
+		if (serverDraining())
+			stopping = 1;
+		uring_listeners();
+		if (stopping && nfree == URING_CONNS)
+			break;
+		if (!tick_armed) {
+			ring_prep(IORING_OP_TIMEOUT, -1, &tick, 1, 0, EVENT(EV_TICK, 0));
+			tick_armed = 1;
+		}
+
+		rc = ring_submit(*ring.cq_head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE));
+		if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY && rc != -ETIME) {
+			debugLog(LOG_ERR, "io_uring_enter: %s\n", strerror(-rc));
+			exit(-rc);
+		}
+		cfg = config_enter();
+		uring_reap(cfg);
+		uring_tables();
+		config_leave();
+	}
+	helpers_stop();
+	ring_close();
+	config_unregister();
+}
+
+#else
+
+int uring_open(const int *fds, int nfds)
+{
+	debugLog(LOG_WARNING, "io_uring: not built in, using the poll loop\n");
+	return -1;
+}
+
+void uring_serve(void)
+{
+}
+
+#endif
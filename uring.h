@@ -0,0 +1,35 @@
+/*
+ * uring.h
+ *
+ * Copyright (C) 2015 Nils Naumann <nau@gmx.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Optional io_uring server loop.  One thread keeps a multishot accept on
+ * every listener; the banner, the command read and the answer of each
+ * connection are ring submissions, and the queries that arrive together
+ * share one read of the socket tables into registered buffers.  Helper
+ * threads build the answers, so nothing that may block runs on the ring.
+ * uring_open() returns -1 if the kernel cannot do this, the caller then
+ * runs the poll loop.
+ */
+#define URING_CONNS   256	/* connections in progress at most */
+#define URING_ENTRIES 512	/* submission queue size */
+#define URING_TABLE   (1 << 20)	/* initial socket table buffer, grows */
+#define URING_HELPERS 4		/* threads that answer the commands, at least */
+
+int uring_open(const int *fds, int nfds);
+void uring_serve(void);
@@ -17,17 +17,15 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <pwd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "userinfo.h"
 
-static char *default_domain=NULL;
-static struct uid_range *included_uids=NULL;
-
-struct uid_range *add_uid_range(uid_t min, uid_t max)
+struct uid_range *add_uid_range(struct userinfo *ui, uid_t min, uid_t max)
 {
 	// walk through the list
-	struct uid_range **hereptr = &included_uids;
+	struct uid_range **hereptr = &ui->included_uids;
 	struct uid_range *here = *hereptr;
 	while (here) {
 		// check if the new range will touch the current range
@@ -38,6 +36,8 @@ struct uid_range *add_uid_range(uid_t min, uid_t max)
 		if (max < here->min) { // non-touching, before
 			// insert the new range before the current one
 			struct uid_range *new = (struct uid_range *)malloc(sizeof(struct uid_range));
+			if (new == NULL)
+				return NULL;
 			new->min = min;
 			new->max = max;
 			new->link = here;
@@ -62,6 +62,8 @@ struct uid_range *add_uid_range(uid_t min, uid_t max)
 	// reached the end of the list without finding a place to insert
 	// append a new range
 	*hereptr = (struct uid_range *)malloc(sizeof(struct uid_range));
+	if (*hereptr == NULL)
+		return NULL;
 	(*hereptr)->min = min;
 	(*hereptr)->max = max;
 	(*hereptr)->link = NULL;
@@ -69,9 +71,9 @@ struct uid_range *add_uid_range(uid_t min, uid_t max)
 }
 
 // check if uid is included in our list of ranges
-int included_uid(uid_t id)
+int included_uid(const struct userinfo *ui, uid_t id)
 {
-	struct uid_range *here = included_uids;
+	struct uid_range *here = ui->included_uids;
 	while (here) {
 		if (here->min <= id && id <= here->max)
 			return 1;
@@ -80,28 +82,56 @@ int included_uid(uid_t id)
 	return 0;
 }
 
-void set_default_domain(const char *domain)
+int set_default_domain(struct userinfo *ui, const char *domain)
 {
-	if (default_domain) free(default_domain);
-	default_domain = strdup(domain);
+	char *copy = strdup(domain);
+	if (copy == NULL)
+		return -1;
+	free(ui->default_domain);
+	ui->default_domain = copy;
+	return 0;
 }
 
-char *add_default_domain(char *username)
+// prefix username with the default domain unless it already has one
+// the result is written to buffer, NULL is returned if it does not fit
+const char *add_default_domain(const struct userinfo *ui, const char *username,
+			       char *buffer, size_t len)
 {
-	static char *buffer=NULL;
-    char *p = strchr(username, '\\');
-    if (p == NULL) {
-		if (default_domain) {
-			if (buffer) free(buffer);
-			buffer=(char *)malloc(strlen(default_domain)+strlen(username)+2);
-			strcpy(buffer, default_domain);
-			strcat(buffer, "\\");
-			strcat(buffer, username);
-			return buffer;
-		}
-		else
-	        return username;
+	int n;
+
+	if (strchr(username, '\\') || ui->default_domain == NULL)
+		n = snprintf(buffer, len, "%s", username);
+	else
+		n = snprintf(buffer, len, "%s\\%s", ui->default_domain, username);
+	if (n < 0 || (size_t)n >= len)
+		return NULL;
+	return buffer;
+}
+
+// fingerprint of the uid ranges and the domain, so shared data built with a
+// different configuration is not used by mistake (FNV-1a)
+unsigned int userinfo_hash(const struct userinfo *ui)
+{
+	unsigned int hash = 2166136261u;
+	struct uid_range *here;
+	const char *p;
+
+	for (here = ui->included_uids; here; here = here->link) {
+		hash = (hash ^ here->min) * 16777619u;
+		hash = (hash ^ here->max) * 16777619u;
+	}
+	for (p = ui->default_domain; p && *p; p++)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	return hash;
+}
+
+void userinfo_free(struct userinfo *ui)
+{
+	while (ui->included_uids) {
+		struct uid_range *next = ui->included_uids->link;
+		free(ui->included_uids);
+		ui->included_uids = next;
 	}
-    else
-        return username;
-}
\ No newline at end of file
+	free(ui->default_domain);
+	ui->default_domain = NULL;
+}
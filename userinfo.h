@@ -18,6 +18,7 @@
  */
 
 #include <pwd.h>
+#include <stddef.h>
 
 struct uid_range {
 	uid_t min;
@@ -25,8 +26,17 @@ struct uid_range {
 	struct uid_range *link;
 };
 
-struct uid_range *add_uid_range(uid_t min, uid_t max);
-int included_uid(uid_t id);
+/* users reported to the Fritz!Box, set up once and then only read */
+struct userinfo {
+	char *default_domain;
+	struct uid_range *included_uids;
+};
+
+struct uid_range *add_uid_range(struct userinfo *ui, uid_t min, uid_t max);
+int included_uid(const struct userinfo *ui, uid_t id);
 
-void set_default_domain(const char *domain);
-char *add_default_domain(char *username);
\ No newline at end of file
+int set_default_domain(struct userinfo *ui, const char *domain);
+const char *add_default_domain(const struct userinfo *ui, const char *username,
+			       char *buffer, size_t len);
+unsigned int userinfo_hash(const struct userinfo *ui);
+void userinfo_free(struct userinfo *ui);